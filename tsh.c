@@ -2,6 +2,7 @@
  * tsh - A tiny shell program with job control
  * 
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,11 +13,44 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXLINE    1024   /* max sprintf message size */
+#define READCHUNK 65536   /* bytes asked for by each read of stdin */
+#define COPYCHUNK (8 << 20) /* bytes the builtin cat moves between checks for ^C */
+#define INITJOBS     16   /* initial size of the job list, it grows as needed */
+#define MAXEVENTS    32   /* max events handled per wakeup */
+#define URINGSIZE    64   /* submission queue entries, with TSH_EVENTS=uring */
+#define REAPRING     64   /* wait statuses held between reaping and applying them */
+#define ARENACHUNK 4096   /* smallest block an arena allocates */
+#define MAXPLANS    256   /* default number of parsed lines kept, see TSH_PLANS */
+#define POOLSIZE      4   /* default number of idle helpers, see TSH_POOL_SIZE */
+#define POOLIDLE     30   /* default seconds a helper waits unused, see TSH_POOL_IDLE */
+#define SPAWNSTACK 65536   /* stack the spawner's children start on */
+#define SPINMAX     200   /* default longest spin in waitfg, in us, see TSH_SPIN */
+#define PIPEBLOCKS  256   /* sleeps per writing stage that mean its pipe was too small */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
@@ -24,6 +58,63 @@
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
 
+/* Event sources, stored in the epoll data of each registered fd */
+#define EV_SIGNAL 0 /* signalfd: SIGCHLD, SIGINT or SIGTSTP arrived */
+#define EV_STDIN  1 /* stdin is readable */
+#define EV_REAPED 2 /* the reaper thread pushed into the ring (-r) */
+#define EV_PROC   3 /* EV_PROC + (slot << 32) + i: pidfd of jobs.slots[slot].procs[i] */
+
+/* Byte classes, see init_scan. Every byte is in at least one class */
+#define BC_WORD  0x01 /* anything not below */
+#define BC_SPACE 0x02 /* ' ' */
+#define BC_QUOTE 0x04 /* '\'' */
+#define BC_OP    0x08 /* | < > & ; ( ) */
+#define BC_END   0x10 /* '\n' or '\0', always a stop for scan */
+#define BC_ALL   0x1f
+
+/* Token types */
+#define T_END    0 /* end of the line */
+#define T_WORD   1 /* a word, possibly quoted */
+#define T_PIPE   2 /* | */
+#define T_OR     3 /* || */
+#define T_AMP    4 /* & */
+#define T_AND    5 /* && */
+#define T_SEMI   6 /* ; */
+#define T_LPAREN 7 /* ( */
+#define T_RPAREN 8 /* ) */
+#define T_IN     9 /* < */
+#define T_OUT   10 /* > */
+
+/* Syntax tree node types */
+#define N_CMD      0 /* simple command */
+#define N_SUBSHELL 1 /* ( list ) */
+#define N_PIPE     2 /* stage | stage | ... */
+#define N_AND      3 /* left && right */
+#define N_OR       4 /* left || right */
+#define N_SEQ      5 /* left ; right */
+#define N_BG       6 /* left & */
+
+/* Builtin kinds */
+#define BI_SHELL 0 /* works on the shell itself (jobs, fg, ...) */
+#define BI_UTIL  1 /* stands in for a program, also as /bin/name and /usr/bin/name */
+#define BI_STAGE 2 /* like BI_UTIL, but only in pipelines; alone it is exec'ed */
+#define BI_COPY  3 /* like BI_STAGE, also alone when is_copy */
+
+/* Escape sequences understood by print_escapes */
+#define ESC_ECHO   0 /* echo -e and printf %b: \0NNN and \NNN */
+#define ESC_FORMAT 1 /* printf formats: \NNN only */
+
+/* Launchers, i.e. how external commands are started */
+#define LAUNCH_FORK  0 /* fork, then set up and execve in the child */
+#define LAUNCH_SPAWN 1 /* posix_spawn, no copy of the shell's address space */
+#define LAUNCH_POOL  2 /* hand the command to a helper forked ahead of time */
+#define LAUNCH_HELPER 3 /* have the spawner, forked at startup, start it */
+
+/* What a pool request carries besides argv, see spawn_pool. Files are
+   opened by the shell and attached like pipe ends */
+#define REQ_IN_FD   1 /* a pipe end for stdin is attached */
+#define REQ_OUT_FD  2 /* a pipe end for stdout is attached */
+
 /* 
  * Jobs states: FG (foreground), BG (background), ST (stopped)
  * Job state transitions and enabling actions:
@@ -40,13 +131,309 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct proc_t {             /* Per-process data, one per pipeline stage */
+    pid_t pid;              /* process PID */
+    int status;             /* wait status, valid once done is set */
+    int done;               /* has the process been reaped? */
+    int pidfd;              /* pidfd for the process, -1 once reaped */
+    long nvcsw;             /* times it blocked, valid once done is set */
+    long cpu;               /* CPU time it used in us, valid once done is set */
+};
+
+/*
+ * Jobs are kept small: the fields every lookup and scan touches sit next
+ * to each other, and the process list and command line live out of line.
+ */
 struct job_t {              /* Per-job data */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID, also the job's process group ID */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, FG, BG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int nprocs;             /* number of processes in the job */
+    int nlive;              /* processes that have not been reaped yet */
+    struct proc_t *procs;   /* nprocs processes, procs[0] leads the group */
+    const char *cmdline;    /* command line, interned in cmdlines */
+};
+
+struct istr_t {             /* An interned string */
+    unsigned hash;          /* hash of text */
+    int refs;               /* number of users */
+    int len;                /* strlen(text) */
+    char text[];            /* the string, exactly len + 1 bytes */
+};
+
+struct strtab_t {           /* Interned strings, one copy per distinct text */
+    struct istr_t **strs;   /* open-addressing buckets, NULL if empty */
+    int cap;                /* number of buckets, a power of two */
+    int count;              /* number of buckets in use */
+};
+struct strtab_t cmdlines;   /* Command lines of the jobs in the job list */
+
+struct pidindex_t {         /* Open-addressing hash index from PID to slot */
+    pid_t *pids;            /* keys, 0 marks an empty bucket */
+    int *slots;             /* slot of the job that owns each PID */
+    int cap;                /* number of buckets, a power of two */
+    int count;              /* number of buckets in use */
+};
+
+struct jidmap_t {           /* Bitmap of the job IDs in use */
+    uint64_t *words;        /* bit b of words[w] is set if jid w*64+b+1 is taken */
+    int nwords;             /* number of words, covers every slot */
+    int hint;               /* no word before this one has a free bit */
+};
+
+struct joblist_t {          /* The job list */
+    struct job_t *slots;    /* job jid lives in slots[jid-1], pid 0 if free */
+    int nslots;             /* number of slots allocated */
+    int fg;                 /* slot of the foreground job, -1 if none */
+    struct pidindex_t pidx; /* PID of every job process -> its slot */
+    struct jidmap_t jids;   /* which job IDs (and so slots) are taken */
+};
+struct joblist_t jobs;      /* The job list */
+
+struct spawn_t {            /* Everything needed to start one process */
+    char **argv;            /* argument list, redirections removed */
+    const char *path;       /* set by spawn_proc: file to exec, from lookup_path,
+                               or from a plan, where "" means not found */
+    char *infile;           /* file named by <, or NULL */
+    char *outfile;          /* file named by >, or NULL */
+    int in_fd;              /* pipe end to use as stdin, or -1 */
+    int out_fd;             /* pipe end to use as stdout, or -1 */
+    pid_t pgid;             /* process group to join, 0 to lead a new one */
+    int pidfd;              /* set by spawn_proc: pidfd for the new process */
+    int errfd;              /* spawner only: pipe to report an exec errno on */
+};
+int launcher = LAUNCH_FORK; /* how external commands are started */
+
+struct helper_t {           /* An idle pre-forked process, see pool_helper */
+    pid_t pid;              /* its PID; it is our child */
+    int sock;               /* our end of its control socket */
+    struct timespec since;  /* when it was forked */
+};
+
+struct pool_t {             /* Helpers waiting for commands (-l pool) */
+    struct helper_t *helpers; /* idle helpers, the newest last */
+    int count;              /* number of idle helpers */
+    int size;               /* number kept ready, TSH_POOL_SIZE */
+    int idle;               /* seconds before an unused helper is retired */
+    int dormant;            /* all retired for idleness, refill on next use */
+};
+struct pool_t pool;
+
+struct spawner_t {          /* The process that starts commands (-l helper) */
+    pid_t pid;              /* its PID */
+    int sock;               /* our end of its socket, -1 if there is none */
+};
+struct spawner_t spawner;
+
+struct spawnreply_t {       /* The spawner's answer to a request */
+    pid_t pid;              /* the new process, our child */
+    int err;                /* errno if it could not exec, else 0 */
+};
+
+struct poolreq_t {          /* Fixed part of a request to a helper */
+    pid_t pgid;             /* process group to join, 0 to lead a new one */
+    int flags;              /* REQ_* */
+    int argc;               /* number of arguments in the body */
+    size_t size;            /* bytes of NUL-terminated strings that follow:
+                               path, then argv */
+};
+
+struct pathent_t {          /* A remembered PATH lookup */
+    char *name;             /* command name, NULL marks an empty bucket */
+    char *path;             /* file to exec, NULL if the name was not found */
+    int dir;                /* PATH directory it was found in, ndirs-1 if not found */
+    int hits;               /* times the entry has been reused */
+};
+
+struct pathcache_t {        /* Command names resolved against $PATH */
+    char *pathvar;          /* copy of the $PATH the entries were made with */
+    char **dirs;            /* pathvar split into its directories */
+    struct timespec *mtimes;/* mtime of each directory when last looked at */
+    int ndirs;              /* number of directories */
+    struct pathent_t *ents; /* open-addressing buckets, keyed by name */
+    int cap;                /* number of buckets, a power of two */
+    int count;              /* number of buckets in use */
+    unsigned gen;           /* bumped every time the entries are forgotten */
+};
+struct pathcache_t pathcache;
+
+int sigfd;                  /* signalfd for SIGCHLD, SIGINT and SIGTSTP */
+char *ballast;              /* memory held to make the shell big, TSH_BALLAST */
+
+struct reap_t {             /* One child state change, as reaped */
+    pid_t pid;              /* the child */
+    int status;             /* its wait status */
+    struct rusage ru;       /* resources it used, if it exited */
+};
+
+/*
+ * Reaping a child and applying its status to the job list are separate
+ * stages joined by this single-producer/single-consumer ring. Each index
+ * is written by one side only and published with release stores, so the
+ * reaper does not have to run on the thread that owns the job list.
+ */
+struct reapring_t {
+    struct reap_t recs[REAPRING];
+    atomic_uint head;       /* next slot to fill, advanced by the reaper */
+    atomic_uint tail;       /* next slot to apply, advanced by apply_reaped */
+};
+struct reapring_t reaped;
+
+struct reaper_t {           /* The reaper thread (-r), the ring's producer */
+    int on;                 /* reaping is done by the thread, not by us */
+    int wake;               /* eventfd: records were pushed, in our epoll set */
+    int kick;               /* eventfd: a child was started, for when it has none */
+    int room;               /* eventfd: the ring has been drained */
+    atomic_int full;        /* set by the thread while waiting for room */
+    pthread_mutex_t lock;   /* held by the thread while it reaps, see kill_job */
+    pthread_t thread;
+};
+struct reaper_t reaper;
+
+struct notices_t {          /* Job notifications waiting to be written */
+    char *buf;              /* the messages, back to back */
+    size_t len;             /* bytes used */
+    size_t cap;             /* bytes allocated */
+};
+struct notices_t notices;
+int epfd;                   /* epoll set the shell sleeps on */
+
+struct uring_t {            /* io_uring used instead of epfd, TSH_EVENTS=uring */
+    int fd;                 /* the ring, -1 when epoll is used */
+    unsigned *sqhead;       /* submission queue, shared with the kernel */
+    unsigned *sqtail;
+    unsigned *sqarray;
+    unsigned sqmask;
+    unsigned sqsize;
+    struct io_uring_sqe *sqes;
+    unsigned *cqhead;       /* completion queue, shared with the kernel */
+    unsigned *cqtail;
+    unsigned cqmask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;        /* SQEs not yet handed to the kernel */
+    int fds[EV_PROC];       /* fd behind each multishot watch, to re-arm it */
+};
+struct uring_t uring = { .fd = -1 };
+sigset_t child_mask;        /* signal mask children start with */
+
+struct token_t {            /* One token of a command line */
+    int type;               /* T_WORD, T_PIPE, ... or T_END */
+    int off;                /* offset of its first byte in the line */
+    int len;                /* number of bytes, quotes excluded */
+    int start, end;         /* the token's text, quotes included, is line[start..end) */
+};
+
+struct lexer_t {            /* Tokenizer state, one per line being split */
+    const char *buf;        /* the line, ends at '\n' or '\0' */
+    int pos;                /* offset of the next byte to look at */
+};
+
+struct chunk_t {            /* One block of arena memory */
+    struct chunk_t *next;   /* next block, kept across resets */
+    size_t cap;             /* bytes in data */
+    char data[];
+};
+
+struct arena_t {            /* Memory for one command line, released all at once */
+    struct chunk_t *first;  /* every block, oldest first */
+    struct chunk_t *cur;    /* block being allocated from */
+    size_t used;            /* bytes of cur handed out */
+};
+struct arena_t linearena;   /* Arena for the line eval is working on */
+
+struct node_t {             /* A node of a command line's syntax tree */
+    int type;               /* N_CMD, N_SUBSHELL, N_PIPE, N_AND, N_OR, N_SEQ or N_BG */
+    struct node_t *left;    /* left operand, first stage, subshell body, or background list */
+    struct node_t *right;   /* right operand */
+    struct node_t *next;    /* next stage of the pipeline this node is a stage of */
+    int nstages;            /* N_PIPE: number of stages */
+    char **argv;            /* N_CMD: arguments, NULL terminated */
+    char *path;             /* N_CMD: file to exec if already looked up, "" if there
+                               was none, or NULL */
+    char *infile;           /* N_CMD and N_SUBSHELL: file named by <, or NULL */
+    char *outfile;          /* N_CMD and N_SUBSHELL: file named by >, or NULL */
+    int start, end;         /* the node's text is line[start..end) */
+};
+
+struct parser_t {           /* Parser state, one per line being parsed */
+    const char *line;       /* the line */
+    struct lexer_t lx;      /* tokenizer for the line */
+    struct token_t tok;     /* the token being looked at */
+    struct arena_t *arena;  /* where the tree is built */
+    int error;              /* has a syntax error been reported? */
+};
+
+struct plan_t {             /* A parsed command line, kept for when it comes again */
+    char *line;             /* the line, the key */
+    unsigned hash;          /* hash of line */
+    struct node_t *root;    /* its syntax tree, with executables looked up */
+    int upto;               /* last PATH directory the lookups looked at, or -1 */
+    struct arena_t arena;   /* holds line, root and everything under it */
+    struct plan_t *prev;    /* previous plan in LRU order, more recently used */
+    struct plan_t *next;    /* next plan in LRU order, less recently used */
+    struct plan_t *chain;   /* next plan in the same bucket */
+};
+
+struct plancache_t {        /* Bounded LRU cache of parsed command lines */
+    struct plan_t **buckets;/* hash chains, keyed by line */
+    int nbuckets;           /* number of buckets, a power of two */
+    struct plan_t *head;    /* most recently used plan */
+    struct plan_t *tail;    /* least recently used plan, evicted first */
+    int count;              /* number of plans kept */
+    int max;                /* most plans kept, 0 to keep none */
+    char *pathvar;          /* $PATH the plans were made with */
+    unsigned gen;           /* pathcache.gen the plans were made with */
+    dev_t dev;              /* current directory the plans were made in */
+    ino_t ino;
+    long hits;              /* lines found in the cache */
+    long misses;            /* lines that had to be parsed */
+};
+struct plancache_t plans;
+
+struct builtin_t {          /* A command the shell runs without exec */
+    const char *name;       /* command name */
+    int (*fn)(char **argv); /* runs it, returns the exit status */
+    int kind;               /* BI_SHELL, BI_UTIL, BI_STAGE or BI_COPY */
+    int (*plain)(char **argv); /* can fn run argv, or is it exec'ed? NULL if always */
+};
+
+int subshell = 0;           /* are we a forked ( ) child, without job control? */
+int fg_status;              /* exit status of the last foreground job */
+
+struct spin_t {             /* Polling, rather than sleeping, in waitfg */
+    long max;               /* longest spin in ns, 0 never to spin */
+    long avg;               /* moving average of foreground waits in ns */
 };
-struct job_t jobs[MAXJOBS]; /* The job list */
+struct spin_t spin;
+
+struct pipesize_t {         /* Buffer size given to pipeline pipes */
+    int cur;                /* size for new pipes */
+    int start;              /* size they start at, and shrink back to */
+    int base;               /* what the kernel gives them anyway */
+    int max;                /* the most we may grow to, 0 never to tune */
+};
+struct pipesize_t pipesize;
+
+int copy_way = -1;          /* way copy_fd tries first (TSH_COPY), -1 to go by file types */
+
+unsigned char bclass[256];  /* class of each byte value */
+int (*scan)(const char *buf, int pos, int stop); /* scan_scalar, scan_sse2 or scan_avx2 */
+
+struct inbuf_t {            /* Input read from stdin but not yet eval'd */
+    char *buf;              /* bytes read so far, grown as needed */
+    size_t cap;             /* bytes allocated for buf */
+    size_t start;           /* offset of the first byte not yet returned */
+    size_t len;             /* offset just past the last byte read */
+    size_t scanned;         /* bytes after start known not to hold a newline */
+    size_t maxline;         /* longest line accepted, ARG_MAX */
+    int skipping;           /* discarding the rest of an overlong line? */
+    char *line;             /* the last line returned, NUL terminated */
+    size_t linecap;         /* bytes allocated for line */
+    int eof;                /* has read returned end of file? */
+    int pollable;           /* is stdin in the epoll set? (files are not) */
+    int ready;              /* has epoll reported stdin readable? */
+};
+struct inbuf_t inbuf;
 
 volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 
@@ -58,27 +445,74 @@ volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
-void do_bgfg(char **argv);
+int do_bgfg(char **argv);
 void waitfg(pid_t pid);
+void init_spin(void);
+void init_pipes(void);
+void init_ballast(void);
+void init_copy(void);
+void tune_pipes(struct job_t *job);
+long elapsed_ns(struct timespec *since);
 void sigchld_handler(int sig);
+struct reap_t *reap_slot(void);
+void reap_commit(void);
+int reap_children(void);
+void reap_pid(pid_t pid);
+void apply_reaped(void);
+void init_reaper(void);
+void *reaper_main(void *arg);
+void reaper_kick(void);
+int wait_status(siginfo_t *si);
+void notice(const char *fmt, ...);
+void flush_notices(void);
+void update_job(struct job_t *job, struct proc_t *proc, int status);
 void sigint_handler(int sig);
 void sigtstp_handler(int sig);
+int kill_job(pid_t pid, int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+struct node_t *parse_line(const char *cmdline, struct arena_t *arena);
+struct node_t *parse_list(struct parser_t *p);
+struct node_t *parse_andor(struct parser_t *p);
+struct node_t *parse_pipeline(struct parser_t *p);
+struct node_t *parse_command(struct parser_t *p);
+int parse_redirection(struct parser_t *p, struct node_t *node);
+struct node_t *new_node(struct parser_t *p, int type, int start);
+void next_token(struct parser_t *p);
+void syntax_error(struct parser_t *p);
+void lex_init(struct lexer_t *lx, const char *buf);
+int lex_next(struct lexer_t *lx, struct token_t *tok);
+void *arena_alloc(struct arena_t *arena, size_t n);
+void arena_reset(struct arena_t *arena);
+void arena_free(struct arena_t *arena);
+void init_scan(void);
+int scan_scalar(const char *buf, int pos, int stop);
+int scan_sse2(const char *buf, int pos, int stop);
+int scan_avx2(const char *buf, int pos, int stop);
 void sigquit_handler(int sig);
 void sigusr1_handler(int sig);
 
 void clearjob(struct job_t *job);
-void initjobs(struct job_t *jobs);
-int freejid(struct job_t *jobs); 
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
-int deletejob(struct job_t *jobs, pid_t pid); 
-pid_t fgpid(struct job_t *jobs);
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
-struct job_t *getjobjid(struct job_t *jobs, int jid); 
+void initjobs(struct joblist_t *jobs);
+int freejid(struct joblist_t *jobs); 
+int addjob(struct joblist_t *jobs, struct proc_t *procs, int nprocs, int state, char *cmdline);
+const char *intern(struct strtab_t *tab, const char *s);
+void unintern(struct strtab_t *tab, const char *s);
+unsigned strhash(const char *s, int len);
+int deletejob(struct joblist_t *jobs, pid_t pid); 
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state);
+pid_t fgpid(struct joblist_t *jobs);
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid);
+struct proc_t *getprocpid(struct job_t *job, pid_t pid);
+struct job_t *getjobjid(struct joblist_t *jobs, int jid); 
 int pid2jid(pid_t pid); 
-void listjobs(struct job_t *jobs);
+void listjobs(struct joblist_t *jobs);
+
+void jidmap_set(struct jidmap_t *map, int jid, int taken);
+unsigned pidindex_bucket(struct pidindex_t *ix, pid_t pid);
+int pidindex_get(struct pidindex_t *ix, pid_t pid);
+void pidindex_put(struct pidindex_t *ix, pid_t pid, int slot);
+void pidindex_del(struct pidindex_t *ix, pid_t pid);
 
 void usage(void);
 void unix_error(char *msg);
@@ -88,16 +522,78 @@ handler_t *Signal(int signum, handler_t *handler);
 
 
 /* Team Define Helpers*/
-void setup_redirection(char **argv);
-int has_piping(char **argv, int argc);
-void my_pipe(char **argv, int argc, sigset_t *prev_mask, char *cmdline);
+int exec_node(struct node_t *node, const char *cmdline);
+int run_pipeline(struct node_t *node, int bg, struct node_t *text, const char *cmdline);
+pid_t spawn_subshell(struct node_t *node, struct spawn_t *sp);
+int exit_status(int status);
+void setup_redirection(struct spawn_t *sp);
+int open_redirection(struct spawn_t *sp, int *files);
+pid_t spawn_proc(struct spawn_t *sp);
+pid_t spawn_fork(struct spawn_t *sp);
+pid_t spawn_posix(struct spawn_t *sp);
+pid_t spawn_pool(struct spawn_t *sp);
+void init_pool(void);
+int pool_tick(void);
+void pool_refill(void);
+void pool_helper(int sock);
+int send_request(int sock, struct spawn_t *sp);
+int recv_request(int sock, struct spawn_t *sp);
+pid_t spawn_helper(struct spawn_t *sp);
+void init_spawner(void);
+void spawner_main(int sock);
+int spawner_child(void *arg);
+int open_pidfd(pid_t pid);
+const char *lookup_path(const char *name, int *upto);
+char *search_path(const char *name, int *dir);
+char **script_argv(const char *path, char **argv);
+int is_executable(const char *path);
+int pathcache_fresh(int upto);
+void pathcache_reset(const char *pathvar);
+void pathcache_flush(void);
+int do_hash(char **argv);
+const struct builtin_t *find_builtin(const char *name);
+int run_builtin(struct node_t *node);
+int do_quit(char **argv);
+int do_jobs(char **argv);
+int do_echo(char **argv);
+int do_true(char **argv);
+int do_false(char **argv);
+int do_test(char **argv);
+int test_expr(char **args, int n);
+int test_int(const char *s, long long *val);
+int do_printf(char **argv);
+int do_tee(char **argv);
+int tee_plain(char **argv);
+long long tee_splice(int *outs, int n, int *status);
+long long tee_copy(int *outs, int n, int *status);
+int splice_all(int in, int out, size_t len);
+int do_cat(char **argv);
+int cat_plain(char **argv);
+int is_copy(struct node_t *node);
+int copy_fd(int in, int out, long long *moved, const char **how);
+int print_escapes(const char *s, int mode);
+void init_plans(void);
+struct node_t *get_plan(const char *cmdline);
+void resolve_plan(struct node_t *node, struct arena_t *arena, int *upto);
+void plans_flush(void);
+void plans_unlink(struct plan_t *plan);
+void plans_drop(struct plan_t *plan);
+void init_events(void);
+void init_uring(void);
+int watch_fd(int fd, uint64_t key, int once);
+void rewatch_fd(int fd, uint64_t key);
+int wait_events(uint64_t *keys, int max, int timeout);
+struct io_uring_sqe *uring_sqe(void);
+void uring_poll(int fd, uint64_t key, int once);
+void poll_events(int timeout);
+char *read_cmdline(void);
 
 /*
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline;
     int emit_prompt = 1; /* emit prompt (default) */
 
     /* Redirect stderr to stdout (so that driver will get all output
@@ -105,7 +601,7 @@ int main(int argc, char **argv) {
     dup2(STDOUT_FILENO, STDERR_FILENO);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt(argc, argv, "hvprl:")) != -1) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -116,6 +612,21 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 'r':             /* reap from a thread of its own */
+                reaper.on = 1;
+                break;
+            case 'l':             /* pick how commands are started */
+                if (strcmp(optarg, "fork") == 0)
+                    launcher = LAUNCH_FORK;
+                else if (strcmp(optarg, "spawn") == 0)
+                    launcher = LAUNCH_SPAWN;
+                else if (strcmp(optarg, "pool") == 0)
+                    launcher = LAUNCH_POOL;
+                else if (strcmp(optarg, "helper") == 0)
+                    launcher = LAUNCH_HELPER;
+                else
+                    usage();
+                break;
             default:
                 usage();
         }
@@ -125,16 +636,43 @@ int main(int argc, char **argv) {
 
     Signal(SIGUSR1, sigusr1_handler); /* Child is ready */
 
-    /* These are the ones you will need to implement */
-    Signal(SIGINT,  sigint_handler);   /* ctrl-c */
-    Signal(SIGTSTP, sigtstp_handler);  /* ctrl-z */
-    Signal(SIGCHLD, sigchld_handler);  /* Terminated or stopped child */
+    /* SIGINT (ctrl-c), SIGTSTP (ctrl-z) and SIGCHLD (terminated or
+     * stopped child) are not caught asynchronously; they are read from a
+     * signalfd by the event loop, see init_events and poll_events */
+    init_events();
+
+    /* With -l helper, fork the spawner before the shell grows */
+    init_spawner();
+
+    /* Pick the fastest way to split command lines this CPU supports */
+    init_scan();
 
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
     /* Initialize the job list */
-    initjobs(jobs);
+    initjobs(&jobs);
+
+    /* Set up the cache of parsed command lines */
+    init_plans();
+
+    /* Size the helper pool; it is topped up whenever we wait */
+    init_pool();
+
+    /* Decide whether waiting for short commands may spin */
+    init_spin();
+
+    /* With -r, start the thread that reaps children */
+    init_reaper();
+
+    /* Pick the starting size for pipeline pipes */
+    init_pipes();
+
+    /* With TSH_BALLAST, grow the shell as if it had been running long */
+    init_ballast();
+
+    /* With TSH_COPY, make the builtin cat start from a given copy method */
+    init_copy();
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -144,13 +682,14 @@ int main(int argc, char **argv) {
             printf("%s", prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        if ((cmdline = read_cmdline()) == NULL) { /* End of file (ctrl-d) */
             fflush(stdout);
             exit(0);
         }
 
+        /* Catch up on children that changed state while we were busy */
+        poll_events(0);
+
         /* Evaluate the command line */
         eval(cmdline);
         fflush(stdout);
@@ -162,448 +701,3671 @@ int main(int argc, char **argv) {
 /* 
  * eval - Evaluate the command line that the user has just typed in
  * 
- * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
- * the foreground, wait for it to terminate and then return.  Note:
- * each child process must have a unique process group ID so that our
- * background children don't receive SIGINT (SIGTSTP) from the kernel
- * when we type ctrl-c (ctrl-z) at the keyboard.  
+ * The line is parsed into a syntax tree of lists (;), conditionals
+ * (&& and ||), background jobs (&), pipelines and ( ) subshells, and
+ * the tree is walked directly, see exec_node. Built-in commands (quit,
+ * jobs, bg, fg, hash) run in the shell itself. Each pipeline is one job
+ * in its own process group, so that our background children don't
+ * receive SIGINT (SIGTSTP) from the kernel when we type ctrl-c (ctrl-z)
+ * at the keyboard.
 */
 void eval(char *cmdline) {
-    char **argv = malloc(sizeof(char *) * MAXARGS);
-    int argc;
-    pid_t pid;
-    int jid;
-    struct job_t *job;
-    int err;
-    sigset_t mask, prev_mask;
-
-    argc = parseline(cmdline, argv);
-
-    if (argc == 0 || argv[0] == NULL) {
-        return;
-    }
-    else if (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "jobs") == 0 || strcmp(argv[0], "bg") == 0 || (strcmp(argv[0], "fg") == 0)) {
-        err = builtin_cmd(argv);
-        if (err != 0) {
-            exit(err);
-        }
-    }
-    else if (has_piping(argv, argc) == 1) { //need to put it in a separate if or else we have a fork within a fork, which is messy
+    struct node_t *root;
 
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGCHLD);
-        sigaddset(&mask, SIGINT);
-        sigaddset(&mask, SIGTSTP);
-        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
-
-        my_pipe(argv, argc, &prev_mask, cmdline);
+    //the tree is either cached or lives in linearena until the end of eval
+    root = get_plan(cmdline);
+    if (root != NULL) {
+        exec_node(root, cmdline);
     }
-    else {
-        sigemptyset(&mask);
-        sigaddset(&mask, SIGCHLD);
-        sigaddset(&mask, SIGINT);
-        sigaddset(&mask, SIGTSTP);
-        sigprocmask(SIG_BLOCK, &mask, &prev_mask);
-        
-        pid = fork();
-
-        if (pid < 0) {
-            printf("Error forking");
-            return;
-        }
-        //in child process
-        if (pid == 0) {
-            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
-            setpgid(0,0);
-            Signal(SIGINT, SIG_DFL);
-            Signal(SIGTSTP, SIG_DFL);
-
-            //for input and output redirection
-            setup_redirection(argv);
-
-            //replace & with null terminator so that exec runs correctly
-            if (strcmp(argv[argc-1], "&") == 0) { //background process
-                argv[argc-1] = '\0';
-            }
-
-            err = execvp(argv[0], argv);
-            if (err < 0) {
-                printf("%s: Command not found\n", argv[0]);
-                exit(err);
-            }
-        }
-
-        //in parent process
-        setpgid(pid, pid);
-        Signal(SIGINT, sigint_handler);
-        Signal(SIGTSTP, sigtstp_handler);
 
-        if (strcmp(argv[argc-1], "&") == 0) { //background process
-            addjob(jobs, pid, BG, cmdline);
-            jid = pid2jid(pid);
-            job = getjobpid(jobs, pid);
-            printf("[%d] (%d) %s", jid, pid, job->cmdline);
-            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
-        } else { //foreground process
-            addjob(jobs, pid, FG, cmdline);
-            sigprocmask(SIG_SETMASK, &prev_mask, NULL);
-            waitfg(pid);
-        }
-
-    }
+    arena_reset(&linearena);
 }
 
-void setup_redirection(char **argv) {
-    int i;
-    for (i = 0; argv[i] != NULL; i++) {
-        if (strcmp(argv[i], "<") == 0) { 
-            int fd0 = open(argv[i+1], O_RDONLY, 0);
-            dup2(fd0, STDIN_FILENO);
-            close(fd0);
-            argv[i] = NULL; // remove redirection from argv so it runs correctly
-        }
-        else if (strcmp(argv[i], ">") == 0) { 
-            int fd1 = open(argv[i+1], O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-            dup2(fd1, STDOUT_FILENO);
-            close(fd1);
-            argv[i] = NULL; 
-        }
-    }
-}
+/*
+ * exec_node - Run the commands of a syntax tree. Returns the exit status,
+ *    0 for success, like $? in other shells.
+ */
+int exec_node(struct node_t *node, const char *cmdline) {
+    const struct builtin_t *bi;
+    int status;
 
-int has_piping(char **argv, int argc) {
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "|") == 0) {
-            return 1; // we found a pipe
-        }
+    switch (node->type) {
+        case N_SEQ:
+            exec_node(node->left, cmdline);
+            return exec_node(node->right, cmdline);
+        case N_AND:
+            status = exec_node(node->left, cmdline);
+            return status == 0 ? exec_node(node->right, cmdline) : status;
+        case N_OR:
+            status = exec_node(node->left, cmdline);
+            return status != 0 ? exec_node(node->right, cmdline) : status;
+        case N_BG:
+            return run_pipeline(node->left, 1, node, cmdline);
+        case N_CMD:
+            if (node->argv[0] != NULL && (bi = find_builtin(node->argv[0])) != NULL &&
+                bi->kind != BI_STAGE && (bi->kind != BI_COPY || is_copy(node))) {
+                return run_builtin(node);
+            }
+            /* fall through */
+        default:
+            return run_pipeline(node, 0, node, cmdline);
     }
-    return 0; // we didn't find a pipe
 }
 
-void my_pipe(char **argv, int argc, sigset_t *prev_mask, char *cmdline) {
-    int err;
-    char *new_argv[MAXARGS][MAXARGS];
-    int count = 0;
-    int sec_count = -1;
+/*
+ * run_pipeline - Start every stage of a pipeline as one job. A node that
+ *    is not N_PIPE is a pipeline of one stage. Stages that are not simple
+ *    commands (subshells, or a whole && list run in the background) and
+ *    builtins that are part of a pipeline or job run in a forked copy of
+ *    the shell, without an exec. The job's command line is the text
+ *    of node text. Returns the exit status of the last stage, or 0 for a
+ *    background job.
+ */
+int run_pipeline(struct node_t *node, int bg, struct node_t *text, const char *cmdline) {
+    const struct builtin_t *bi;
+    struct node_t *stage;
+    struct proc_t *procs;
+    struct job_t *job;
+    char *jobline;
+    int count = (node->type == N_PIPE) ? node->nstages : 1;
+    int nforked = 0;
     int pipefd[2];
     int prev_fd = -1;
+    int status = 0;
     pid_t pid = 0;
-    int jid;
-    struct job_t *job;
+    pid_t pgid = subshell ? getpgrp() : 0;
 
-    //parsing command line
-    //split on the |, store in a 2d array of strings. for example:
-    //ls | grep .txt -> [ [ls], [grep .txt] ]
+    procs = arena_alloc(&linearena, count * sizeof(struct proc_t));
 
-    for (int i = 0; i < argc; i++) {
-        if (strcmp(argv[i], "|") == 0) {
-            sec_count = -1;
-            count ++;
-        } else {
-            sec_count ++;
-            new_argv[count][sec_count] = argv[i];
-        }
-    }
-    count ++; // this is necessary for some reason, it breaks without it.
-    //loop over the 2d array
-    for (int j = 0; j < count; j++) {
+    //start every stage up front so they all run at the same time. the first
+    //stage becomes the process group leader and the rest join its group, so
+    //the whole pipeline can be signalled and waited on as one unit.
+    stage = (node->type == N_PIPE) ? node->left : node;
+    for (int j = 0; j < count; j++, stage = stage->next) {
+        struct spawn_t sp;
 
-        err = pipe(pipefd);
-        if (err != 0) {
-            printf("Piping error");
-            return;
+        //close-on-exec, so the pipe ends only survive where we dup2 them
+        if (j < count - 1 && pipe2(pipefd, O_CLOEXEC) != 0) {
+            perror("pipe");
+            break;
         }
+        if (j < count - 1 && pipesize.cur != pipesize.base)
+            fcntl(pipefd[1], F_SETPIPE_SZ, pipesize.cur); // best effort
 
-        pid = fork();
-        if (pid == 0) { //child process
-            sigprocmask(SIG_SETMASK, prev_mask, NULL);
-            setpgid(0,0);
-            Signal(SIGINT, SIG_DFL);
-            Signal(SIGTSTP, SIG_DFL);
+        //if we are not at the first command, get input from the previous command. 
+        //no else bc if we are at the first command, we just take input from STDIN
+        sp.in_fd = prev_fd;
+        //if we are not at the last command, then redirect output to the pipe
+        sp.out_fd = (j < count - 1) ? pipefd[1] : -1;
+        sp.pgid = pgid;
+        sp.argv = stage->argv;
+        sp.path = stage->path;
+        sp.infile = (stage->type == N_CMD || stage->type == N_SUBSHELL) ? stage->infile : NULL;
+        sp.outfile = (stage->type == N_CMD || stage->type == N_SUBSHELL) ? stage->outfile : NULL;
 
-            //for input and output redirection
-            setup_redirection(new_argv[j]);
-
-            if (prev_fd != -1) {
-                //if we are not at the first command, get input from the previous command. 
-                //no else bc if we are at the first command, we just take input from STDIN
-                dup2(prev_fd, STDIN_FILENO);
-                close(prev_fd);
-            }
+        //stage builtins only stand in for a program between pipes; a
+        //lone one, even in the background, is exec'ed
+        if (stage->type == N_CMD && (stage->argv[0] == NULL || (bi = find_builtin(stage->argv[0])) == NULL ||
+                                     (bi->kind >= BI_STAGE && count == 1) ||
+                                     (bi->plain != NULL && !bi->plain(stage->argv))))
+            pid = spawn_proc(&sp);
+        else
+            pid = spawn_subshell(stage, &sp);
 
-            //if we are not at the last command, then redirect output to fd
-            if (j < count - 1) {
-                dup2(pipefd[1], STDOUT_FILENO);
+        //parent process
+        if (pid > 0) {
+            if (pgid == 0) {
+                pgid = pid;
             }
-            
-            err = execvp(new_argv[j][0], new_argv[j]);
-            if (err == -1) {
-                fprintf(stderr, "Failed to execute command: %s\n", new_argv[j][0]);
-                return;
-            }
-        
-            close(pipefd[0]);
-
-        } else if (pid < 0) {
-            perror("fork");
-            return;
-        } else { //parent process
-            setpgid(pid, pid);
-            Signal(SIGINT, sigint_handler);
-            Signal(SIGTSTP, sigtstp_handler);
+            procs[nforked].pid = pid;
+            procs[nforked].pidfd = sp.pidfd;
+            nforked++;
+        }
 
-            if (prev_fd != -1) {
-                close(prev_fd); // close the last reading end
-            }
+        if (prev_fd != -1) {
+            close(prev_fd); // close the last reading end
+        }
+        if (j < count - 1) {
             close(pipefd[1]); //closing the writing end
             prev_fd = pipefd[0]; // save read end for the next command
+        } else {
+            prev_fd = -1;
+        }
+    }
+    if (prev_fd != -1) {
+        close(prev_fd); // a pipe failed, nobody will read this
+    }
+    if (nforked == 0) {
+        return 127;
+    }
 
-            //exact same thing we do for a regular process
-            if (strcmp(argv[argc-1], "&") == 0) { //background process
-                addjob(jobs, pid, BG, cmdline);
-                jid = pid2jid(pid);
-                job = getjobpid(jobs, pid);
-                printf("[%d] (%d) %s", jid, pid, job->cmdline);
-                //pass in prev_mask instead of &prev_mask bc in this function its passed as an address
-                sigprocmask(SIG_SETMASK, prev_mask, NULL);
-            } else { //foreground process
-                addjob(jobs, pid, FG, cmdline);
-                //pass in prev_mask instead of &prev_mask bc in this function its passed as an address
-                sigprocmask(SIG_SETMASK, prev_mask, NULL);
-                waitfg(pid);
-            }
+    //inside a subshell there is no job control: the stages share our
+    //process group, and we simply wait for them
+    if (subshell) {
+        for (int j = 0; j < nforked; j++) {
+            if (procs[j].pidfd != -1)
+                close(procs[j].pidfd);
+            if (!bg && waitpid(procs[j].pid, &status, 0) > 0)
+                status = exit_status(status);
+        }
+        return bg ? 0 : (pid > 0 ? status : 127);
+    }
 
+    //the job's text is its own part of the line, or the whole line if it
+    //is the only thing on it
+    jobline = arena_alloc(&linearena, text->end - text->start + 2);
+    memcpy(jobline, cmdline + text->start, text->end - text->start);
+    jobline[text->end - text->start] = '\0';
+    if (text->end == text->start || cmdline[text->end - 1] != '\n')
+        strcat(jobline, "\n");
+
+    //the whole pipeline is one job. children are only reaped from the
+    //event loop, so no stage can be reaped before it has been registered.
+    if (!addjob(&jobs, procs, nforked, bg ? BG : FG, jobline)) {
+        //nothing would ever wait for the stages, so kill and reap them
+        //here rather than leave them and their pidfds behind
+        kill(-pgid, SIGKILL);
+        for (int j = 0; j < nforked; j++) {
+            if (procs[j].pidfd != -1)
+                close(procs[j].pidfd);
+            while (waitpid(procs[j].pid, NULL, 0) < 0 && errno == EINTR)
+                ;
         }
+        return 1;
+    }
+    if (bg) {
+        job = getjobpid(&jobs, pgid);
+        printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+        return 0;
     }
 
+    //all stages are already running, so the pipeline takes as long as its
+    //slowest stage rather than the sum of all of them
+    waitfg(pgid);
+    return pid > 0 ? fg_status : 127;
 }
 
-/* 
- * parseline - Parse the command line and build the argv array.
- * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+/*
+ * spawn_subshell - Fork a copy of the shell to run node, for ( ) and for
+ *    compound commands that have to run as one background job. The copy
+ *    has no job control: it runs each pipeline in its own process group,
+ *    so ctrl-c and ctrl-z reach everything it starts.
  */
-int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to space or quote delimiters */
-    int argc;                   /* number of args */
-
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-        buf++;
+pid_t spawn_subshell(struct node_t *node, struct spawn_t *sp) {
+    pid_t pid;
 
-    /* Build the argv list */
-    argc = 0;
-    if (*buf == '\'') {
-        buf++;
-        delim = strchr(buf, '\'');
+    fflush(stdout); // or the child would print our buffered output again
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
     }
-    else {
-        delim = strchr(buf, ' ');
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        setpgid(0, sp->pgid);
+        setup_redirection(sp);
+
+        //nothing else the shell has open is any use here: the epoll set,
+        //the signalfd, pidfds and the other ends of our pipes. The reaper
+        //thread and the io_uring mappings did not come along either.
+        syscall(SYS_close_range, 3, ~0U, 0);
+
+        subshell = 1;
+        reaper.on = 0;
+        uring.fd = -1;
+        if (node->type == N_CMD)
+            exit(builtin_cmd(node->argv)); // redirections are already done
+        exit(exec_node(node->type == N_SUBSHELL ? node->left : node, ""));
     }
 
-    while (delim) {
-        argv[argc++] = buf;
-        *delim = '\0';
-        buf = delim + 1;
-        while (*buf && (*buf == ' ')) /* ignore spaces */
-            buf++;
+    //also done by the child, whichever runs first wins the race
+    setpgid(pid, sp->pgid ? sp->pgid : pid);
+    sp->pidfd = open_pidfd(pid);
+    return pid;
+}
+
+/* exit_status - Turn a wait status into an exit status, like $? */
+int exit_status(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 0;
+}
 
-        if (*buf == '\'') {
-            buf++;
-            delim = strchr(buf, '\'');
+/*
+ * setup_redirection - In the child, install the pipe ends and then the
+ *    redirection files as stdin/stdout. Explicit redirections win over
+ *    the pipe, like in other shells. A file that cannot be opened is
+ *    reported and the child exits, rather than running the command on
+ *    the shell's own stdin or stdout.
+ */
+void setup_redirection(struct spawn_t *sp) {
+    if (sp->in_fd != -1) {
+        dup2(sp->in_fd, STDIN_FILENO);
+    }
+    if (sp->out_fd != -1) {
+        dup2(sp->out_fd, STDOUT_FILENO);
+    }
+    if (sp->infile != NULL) { 
+        int fd0 = open(sp->infile, O_RDONLY, 0);
+        if (fd0 < 0) {
+            printf("%s: %s\n", sp->infile, strerror(errno));
+            exit(1);
         }
-        else {
-            delim = strchr(buf, ' ');
+        dup2(fd0, STDIN_FILENO);
+        close(fd0);
+    }
+    if (sp->outfile != NULL) { 
+        int fd1 = open(sp->outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd1 < 0) {
+            printf("%s: %s\n", sp->outfile, strerror(errno));
+            exit(1);
         }
+        dup2(fd1, STDOUT_FILENO);
+        close(fd1);
     }
-    argv[argc] = NULL;
-    
-    return argc;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/*
+ * open_redirection - Open the redirection files in the shell, for the
+ *    launchers whose child cannot report or be interrupted while doing
+ *    it, and use them in place of the pipe ends, which they win over
+ *    anyway. files gets the fds opened, -1 for none, for the caller to
+ *    close once the new process has its copies. A FIFO is not opened:
+ *    that waits for the other end, where ^C could not stop the shell.
+ *    Returns 0, 1 if there is a FIFO and the child has to open the
+ *    files itself, or -1 after reporting a file that cannot be opened.
  */
-int builtin_cmd(char **argv) {
-    if (strcmp(argv[0], "quit") == 0) {
-        exit(0); // Exit the shell
-    } else if (strcmp(argv[0], "jobs") == 0) {
-        listjobs(jobs); // List all background jobs
-        return 0;
-    } else if (strcmp(argv[0], "bg") == 0 || strcmp(argv[0], "fg") == 0) {
-        do_bgfg(argv); // Execute bg or fg command
-        return 0;
-    } else {
+int open_redirection(struct spawn_t *sp, int *files) {
+    struct stat st;
+
+    files[0] = files[1] = -1;
+    if ((sp->infile != NULL && stat(sp->infile, &st) == 0 && S_ISFIFO(st.st_mode)) ||
+        (sp->outfile != NULL && stat(sp->outfile, &st) == 0 && S_ISFIFO(st.st_mode)))
         return 1;
+
+    if (sp->infile != NULL && (files[0] = open(sp->infile, O_RDONLY | O_CLOEXEC)) < 0) {
+        printf("%s: %s\n", sp->infile, strerror(errno));
+        fflush(stdout);
+        return -1;
+    }
+    if (sp->outfile != NULL &&
+        (files[1] = open(sp->outfile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)) < 0) {
+        printf("%s: %s\n", sp->outfile, strerror(errno));
+        fflush(stdout);
+        if (files[0] != -1)
+            close(files[0]);
+        return -1;
+    }
+    if (files[0] != -1) {
+        sp->in_fd = files[0];
+        sp->infile = NULL;
     }
+    if (files[1] != -1) {
+        sp->out_fd = files[1];
+        sp->outfile = NULL;
+    }
+    return 0;
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands
+/*
+ * spawn_proc - Start the process described by sp with the configured
+ *    launcher. The new process runs with child_mask rather than the
+ *    shell's mask. Unless sp->path was taken from a cached plan, the
+ *    command is resolved here, in the parent, so unknown commands never
+ *    cost a process. Returns the new PID, or 0 if
+ *    the process could not be started.
  */
-void do_bgfg(char **argv) {
-    struct job_t *cur_job;
-    int pid, jid;
-    char *id = NULL;
-    
-    //ensuring we actually have an id argument
-    if (argv[1] == NULL) {
-        printf("%s command requires PID or %%jid argument\n", argv[0]);
-        return;
-    } else {
-        id = argv[1];
-    }
+pid_t spawn_proc(struct spawn_t *sp) {
+    pid_t pid;
 
-    if (id[0] == '%') {
-        jid = atoi(&id[1]);
-        if (jid == 0) {
-            printf("%s: argument must be a PID or %%jid\n", argv[0]);
-            return;
-        }
-        cur_job = getjobjid(jobs, jid);
-        if (cur_job == NULL) {
-            printf("%%%d: No such job\n", jid);
-            return;
-        }
+    sp->pidfd = -1;
+    if (sp->argv[0] == NULL) {
+        return 0;
     }
-    else {
-        pid = atoi(&id[0]);
-        if (pid == 0) {
-            printf("%s: argument must be a PID or %%jid\n", argv[0]);
-            return;
-        }
-        cur_job = getjobpid(jobs, pid);
-        if (cur_job == NULL) {
-            printf("(%d): No such process\n", pid);
-            return;
-        }    
+    //anything still buffered would be printed again by a forked child
+    //that fails to exec, or come out after the new process's output
+    fflush(stdout);
+    if (sp->path == NULL)
+        sp->path = lookup_path(sp->argv[0], NULL);
+    if (sp->path == NULL || sp->path[0] == '\0') {
+        printf("%s: Command not found\n", sp->argv[0]);
+        fflush(stdout);
+        return 0;
     }
 
-    if (strcmp(argv[0], "bg") == 0 && cur_job->state == ST) {
-        kill(-(cur_job->pid), SIGCONT);
-        cur_job->state = BG;
-        printf("[%d] (%d) %s", cur_job->jid, cur_job->pid, cur_job->cmdline);
-    } 
-    else if (strcmp(argv[0], "fg") == 0 && (cur_job->state == ST || cur_job->state == BG )) {
-        kill(-(cur_job->pid), SIGCONT);
-        cur_job->state = FG;
-        waitfg(cur_job->pid);
+    if (launcher == LAUNCH_SPAWN)
+        pid = spawn_posix(sp);
+    else if (launcher == LAUNCH_POOL && !subshell)
+        pid = spawn_pool(sp);
+    else if (launcher == LAUNCH_HELPER && !subshell)
+        pid = spawn_helper(sp);
+    else
+        pid = spawn_fork(sp);
+
+    //also done by the child, whichever runs first wins the race
+    if (pid > 0) {
+        setpgid(pid, sp->pgid ? sp->pgid : pid);
+        sp->pidfd = open_pidfd(pid);
     }
+    return pid;
+}
 
+/*
+ * open_pidfd - Get a pidfd for our child pid. Children are only reaped
+ *    from the event loop, so the pid still refers to our child here.
+ *    Returns -1 on kernels without pidfds; waitfg copes with that. With
+ *    the reaper thread there are no pidfds, it is woken up instead.
+ */
+int open_pidfd(pid_t pid) {
+    if (reaper.on) {
+        reaper_kick();
+        return -1;
+    }
+    return syscall(SYS_pidfd_open, pid, 0);
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * spawn_fork - fork a copy of the shell and exec the command from it
  */
-void waitfg(pid_t pid) {
-    sigset_t mask, prev_mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &mask, &prev_mask);
+pid_t spawn_fork(struct spawn_t *sp) {
+    pid_t pid = fork();
 
-    // Suspend until the job is no longer in the foreground
-    while (fgpid(jobs) == pid) {
-        sigsuspend(&prev_mask);
+    if (pid < 0) {
+        perror("fork");
+        return 0;
     }
+    //in child process
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        setpgid(0, sp->pgid);
+
+        //for input and output redirection
+        setup_redirection(sp);
 
-    sigprocmask(SIG_SETMASK, &prev_mask, NULL);
+        execve(sp->path, sp->argv, environ);
+        if (errno == ENOEXEC)
+            execve("/bin/sh", script_argv(sp->path, sp->argv), environ);
+        printf("%s: Command not found\n", sp->argv[0]);
+        exit(1);
+    }
+    return pid;
 }
 
+/*
+ * spawn_posix - Start the command with posix_spawn. glibc creates the
+ *    child with clone(CLONE_VM|CLONE_VFORK), so unlike fork it does not
+ *    have to copy the shell's page tables, and exec failures are reported
+ *    back to us instead of being printed by the child. The shell waits
+ *    until the exec, so the redirection files are opened here first,
+ *    and commands redirected to a FIFO go to spawn_fork.
+ */
+pid_t spawn_posix(struct spawn_t *sp) {
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults;
+    pid_t pid;
+    int files[2];
+    int err;
 
-/*****************
- * Signal handlers
- *****************/
+    err = open_redirection(sp, files);
+    if (err > 0)
+        return spawn_fork(sp);
+    if (err < 0)
+        return 0;
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGUSR1);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, sp->pgid);
+    posix_spawnattr_setsigmask(&attr, &child_mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    //the files, if any, are already in place of the pipe ends
+    posix_spawn_file_actions_init(&actions);
+    if (sp->in_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, sp->in_fd, STDIN_FILENO);
+    if (sp->out_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, sp->out_fd, STDOUT_FILENO);
+
+    err = posix_spawn(&pid, sp->path, &actions, &attr, sp->argv, environ);
+    if (err == ENOEXEC)
+        err = posix_spawn(&pid, "/bin/sh", &actions, &attr, script_argv(sp->path, sp->argv), environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (int i = 0; i < 2; i++) {
+        if (files[i] != -1)
+            close(files[i]);
+    }
+
+    if (err == ENOENT || err == EACCES || err == ENOEXEC) {
+        printf("%s: Command not found\n", sp->argv[0]);
+        return 0;
+    } else if (err != 0) {
+        printf("%s: %s\n", sp->argv[0], strerror(err));
+        return 0;
+    }
+    return pid;
+}
+
+/*
+ * send_request - Send the command in sp to a helper on sock: a poolreq_t
+ *    with the pipe ends attached as SCM_RIGHTS, then the strings. The
+ *    fds stay open on our side. Returns 0, or -1 if the helper is gone.
+ */
+int send_request(int sock, struct spawn_t *sp) {
+    struct poolreq_t req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {                 /* room for the two fds, suitably aligned */
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    int fds[2], nfds, i;
+    char *body, *p;
+    ssize_t n;
+    size_t off;
+
+    memset(&req, 0, sizeof(req));
+    req.pgid = sp->pgid;
+    req.size = strlen(sp->path) + 1;
+    nfds = 0;
+    if (sp->in_fd != -1) {
+        req.flags |= REQ_IN_FD;
+        fds[nfds++] = sp->in_fd;
+    }
+    if (sp->out_fd != -1) {
+        req.flags |= REQ_OUT_FD;
+        fds[nfds++] = sp->out_fd;
+    }
+    for (req.argc = 0; sp->argv[req.argc] != NULL; req.argc++)
+        req.size += strlen(sp->argv[req.argc]) + 1;
+
+    body = p = arena_alloc(&linearena, req.size);
+    p = stpcpy(p, sp->path) + 1;
+    for (i = 0; i < req.argc; i++)
+        p = stpcpy(p, sp->argv[i]) + 1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds > 0) {
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+    }
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(req))
+        return -1;
+    for (off = 0; off < req.size; off += n) {
+        n = send(sock, body + off, req.size - off, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * recv_request - The helper's side of send_request: fill in sp from the
+ *    next request on sock. sp->argv is one malloc'ed block holding the
+ *    strings too; the received fds are close-on-exec. Returns 0, or -1
+ *    at EOF or on a short read.
+ */
+int recv_request(int sock, struct spawn_t *sp) {
+    struct poolreq_t req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    int fds[2] = {-1, -1}, nfds, i;
+    char *p;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR)
+        ;
+    if (n != sizeof(req))
+        return -1;
+    cm = CMSG_FIRSTHDR(&msg);
+    if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cm), (nfds < 2 ? nfds : 2) * sizeof(int));
+    }
+
+    sp->argv = malloc((req.argc + 1) * sizeof(char *) + req.size);
+    if (sp->argv == NULL)
+        return -1;
+    p = (char *)(sp->argv + req.argc + 1);
+    if (recv(sock, p, req.size, MSG_WAITALL) != (ssize_t)req.size) {
+        free(sp->argv);
+        return -1;
+    }
+
+    //unpack in the order send_request packed it
+    sp->path = p;
+    p += strlen(p) + 1;
+    sp->infile = sp->outfile = NULL;
+    for (i = 0; i < req.argc; i++) {
+        sp->argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    sp->argv[req.argc] = NULL;
+    i = 0;
+    sp->in_fd = (req.flags & REQ_IN_FD) ? fds[i++] : -1;
+    sp->out_fd = (req.flags & REQ_OUT_FD) ? fds[i++] : -1;
+    sp->pgid = req.pgid;
+    return 0;
+}
+
+/*
+ * spawn_pool - Hand the command to an idle helper from the pool, so the
+ *    shell does not fork on the way to the exec. The helper becomes the
+ *    process, and the socket closing on exec is its way of saying it
+ *    worked. The shell waits for that, so the redirection files are
+ *    opened here and sent along with the pipe ends; a FIFO, which could
+ *    keep us waiting, is left to spawn_fork. Falls back to spawn_fork
+ *    too when no helper is left.
+ */
+pid_t spawn_pool(struct spawn_t *sp) {
+    struct helper_t h;
+    ssize_t n;
+    pid_t pid = 0;
+    int files[2];
+    int err;
+
+    err = open_redirection(sp, files);
+    if (err > 0)
+        return spawn_fork(sp);
+    if (err < 0)
+        return 0;
+
+    //there is demand again, see pool_tick
+    pool.dormant = 0;
+    while (pool.count > 0 && pid == 0) {
+        h = pool.helpers[--pool.count];
+        if (send_request(h.sock, sp) < 0) {
+            //died or was killed while idle; it gets reaped as an unknown pid
+            kill(h.pid, SIGKILL);
+            close(h.sock);
+            continue;
+        }
+
+        //EOF once the exec closes the socket, an errno if it failed
+        while ((n = read(h.sock, &err, sizeof(err))) < 0 && errno == EINTR)
+            ;
+        close(h.sock);
+        if (n == sizeof(err)) {
+            if (err == ENOENT || err == EACCES || err == ENOEXEC)
+                printf("%s: Command not found\n", sp->argv[0]);
+            else
+                printf("%s: %s\n", sp->argv[0], strerror(err));
+            fflush(stdout);
+            pid = -1;
+        } else {
+            pid = h.pid;
+        }
+    }
+
+    if (pid == 0)
+        pid = spawn_fork(sp);
+    for (int i = 0; i < 2; i++) {
+        if (files[i] != -1)
+            close(files[i]);
+    }
+    return pid > 0 ? pid : 0;
+}
+
+/*
+ * init_pool - Read the pool knobs: TSH_POOL_SIZE helpers (POOLSIZE if
+ *    unset, 0 for none), each retired after TSH_POOL_IDLE seconds unused.
+ */
+void init_pool(void) {
+    const char *env;
+
+    if (launcher != LAUNCH_POOL)
+        return;
+    env = getenv("TSH_POOL_SIZE");
+    pool.size = env ? atoi(env) : POOLSIZE;
+    env = getenv("TSH_POOL_IDLE");
+    pool.idle = env ? atoi(env) : POOLIDLE;
+    if (pool.size <= 0 || pool.idle <= 0) {
+        pool.size = 0;
+        launcher = LAUNCH_FORK;
+        return;
+    }
+    pool.helpers = malloc(pool.size * sizeof(struct helper_t));
+    if (pool.helpers == NULL)
+        unix_error("init_pool error");
+}
+
+/*
+ * pool_tick - Housekeeping for the pool, run whenever the shell is about
+ *    to wait for input: retire helpers that have sat unused for too long.
+ *    Once helpers start retiring the pool stops refilling until a command
+ *    takes one. Returns how many ms the caller may sleep before there is
+ *    more to do: 0 if a helper is missing, see pool_refill, else until the
+ *    next one is due to retire, -1 if none is.
+ */
+int pool_tick(void) {
+    struct timespec now;
+    long ms;
+    int i;
+
+    if (pool.size == 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    //helpers are kept in the order they were forked, the oldest first
+    for (i = 0; i < pool.count; i++) {
+        if (now.tv_sec - pool.helpers[i].since.tv_sec < pool.idle)
+            break;
+        kill(pool.helpers[i].pid, SIGKILL);
+        close(pool.helpers[i].sock);
+    }
+    if (i > 0) {
+        memmove(pool.helpers, pool.helpers + i, (pool.count - i) * sizeof(struct helper_t));
+        pool.count -= i;
+        pool.dormant = 1;
+    }
+
+    if (!pool.dormant && pool.count < pool.size)
+        return 0;
+    if (pool.count == 0)
+        return -1;
+    ms = (pool.helpers[0].since.tv_sec + pool.idle - now.tv_sec) * 1000L
+        + (pool.helpers[0].since.tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+/*
+ * pool_refill - Fork one helper if the pool is short of one. Only called
+ *    when there is nothing to read, so a line that arrives meanwhile waits
+ *    for one fork at most, never for the whole pool or on a command.
+ */
+void pool_refill(void) {
+    struct helper_t h;
+    int sv[2];
+    pid_t pid;
+
+    if (pool.dormant || pool.count >= pool.size)
+        return;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return;
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        pool_helper(sv[1]);
+    }
+    close(sv[1]);
+    reaper_kick();
+    h.pid = pid;
+    h.sock = sv[0];
+    clock_gettime(CLOCK_MONOTONIC, &h.since);
+    //spawn_pool takes the newest, so new helpers go on top
+    pool.helpers[pool.count++] = h;
+    //also done by the helper, whichever runs first wins the race
+    setpgid(pid, pid);
+}
+
+/*
+ * pool_helper - Body of a pooled helper. It sits in a process group of
+ *    its own, out of reach of ctrl-c, until a request arrives, then sets
+ *    itself up the way spawn_fork's child would and execs. Exits when
+ *    the shell closes the socket.
+ */
+void pool_helper(int sock) {
+    struct spawn_t sp;
+    int err;
+
+    //keep only stdio and the socket, which the exec will close
+    if (sock != 3) {
+        dup3(sock, 3, O_CLOEXEC);
+        sock = 3;
+    }
+    syscall(SYS_close_range, 4, ~0U, 0);
+    setpgid(0, 0);
+
+    if (recv_request(sock, &sp) < 0)
+        _exit(0);
+
+    //a ctrl-c or ctrl-z that came in while idle was not meant for this
+    //command; ignoring a pending signal discards it
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+
+    setpgid(0, sp.pgid);
+    setup_redirection(&sp);
+    sigprocmask(SIG_SETMASK, &child_mask, NULL);
+
+    execve(sp.path, sp.argv, environ);
+    if (errno == ENOEXEC)
+        execve("/bin/sh", script_argv(sp.path, sp.argv), environ);
+    err = errno;
+    write(sock, &err, sizeof(err));
+    _exit(127);
+}
+
+/*
+ * spawn_helper - Have the spawner start the command. The new process is
+ *    still our child, so it is reaped and job-controlled like any other.
+ *    The spawner only answers after the exec, so as for spawn_pool the
+ *    redirection files are opened here and a FIFO goes to spawn_fork.
+ *    Falls back to spawn_fork too if the spawner has gone away.
+ */
+pid_t spawn_helper(struct spawn_t *sp) {
+    struct spawnreply_t reply;
+    ssize_t n = -1;
+    pid_t pid = 0;
+    int files[2], err;
+
+    err = open_redirection(sp, files);
+    if (err > 0)
+        return spawn_fork(sp);
+    if (err < 0)
+        return 0;
+
+    if (spawner.sock != -1 && send_request(spawner.sock, sp) == 0) {
+        while ((n = read(spawner.sock, &reply, sizeof(reply))) < 0 && errno == EINTR)
+            ;
+    }
+    if (n != sizeof(reply)) {
+        if (spawner.sock != -1) {
+            kill(spawner.pid, SIGKILL);
+            close(spawner.sock);
+            spawner.sock = -1;
+        }
+        pid = spawn_fork(sp);
+    } else if (reply.err == ENOENT || reply.err == EACCES || reply.err == ENOEXEC) {
+        printf("%s: Command not found\n", sp->argv[0]);
+    } else if (reply.err != 0) {
+        printf("%s: %s\n", sp->argv[0], strerror(reply.err));
+    } else {
+        pid = reply.pid;
+    }
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        if (files[i] != -1)
+            close(files[i]);
+    }
+    return pid;
+}
+
+/*
+ * init_spawner - Fork the spawner while the shell is still small: no job
+ *    table, caches or parsed lines yet, so every process it makes later
+ *    costs a fork of this footprint rather than of the grown shell.
+ */
+void init_spawner(void) {
+    int sv[2];
+    pid_t pid;
+
+    spawner.sock = -1;
+    if (launcher != LAUNCH_HELPER)
+        return;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        unix_error("init_spawner error");
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        unix_error("init_spawner error");
+    if (pid == 0) {
+        close(sv[0]);
+        spawner_main(sv[1]);
+    }
+    close(sv[1]);
+    setpgid(pid, pid);
+    spawner.pid = pid;
+    spawner.sock = sv[0];
+}
+
+/*
+ * spawner_main - Body of the spawner. For each request it clones a
+ *    process with CLONE_PARENT, which makes it the shell's child rather
+ *    than ours, waits for it to exec through a close-on-exec pipe and
+ *    reports the pid or the exec errno. Exits when the shell does.
+ */
+void spawner_main(int sock) {
+    static char stack[SPAWNSTACK];  /* the cloned child runs on a copy */
+    struct spawnreply_t reply;
+    struct spawn_t sp;
+    int errfd[2];
+
+    if (sock != 3) {
+        dup3(sock, 3, O_CLOEXEC);
+        sock = 3;
+    }
+    syscall(SYS_close_range, 4, ~0U, 0);
+    setpgid(0, 0);
+
+    while (recv_request(sock, &sp) == 0) {
+        reply.err = 0;
+        reply.pid = 0;
+        if (pipe2(errfd, O_CLOEXEC) < 0) {
+            reply.err = errno;
+        } else {
+            sp.errfd = errfd[1];
+            reply.pid = clone(spawner_child, stack + sizeof(stack), CLONE_PARENT | SIGCHLD, &sp);
+            if (reply.pid < 0)
+                reply.err = errno;
+            close(errfd[1]);
+            //EOF once the exec closes the pipe, an errno if it failed
+            if (reply.pid > 0 && read(errfd[0], &reply.err, sizeof(reply.err)) != sizeof(reply.err))
+                reply.err = 0;
+            close(errfd[0]);
+        }
+        if (sp.in_fd != -1)
+            close(sp.in_fd);
+        if (sp.out_fd != -1)
+            close(sp.out_fd);
+        free(sp.argv);
+        if (write(sock, &reply, sizeof(reply)) != sizeof(reply))
+            break;
+    }
+    _exit(0);
+}
+
+/*
+ * spawner_child - Runs in the cloned process: set up like spawn_fork's
+ *    child and exec. An exec failure goes back to the spawner on the
+ *    pipe passed in sp->errfd.
+ */
+int spawner_child(void *arg) {
+    struct spawn_t *sp = arg;
+    int err;
+
+    setpgid(0, sp->pgid);
+    setup_redirection(sp);
+    sigprocmask(SIG_SETMASK, &child_mask, NULL);
+
+    execve(sp->path, sp->argv, environ);
+    if (errno == ENOEXEC)
+        execve("/bin/sh", script_argv(sp->path, sp->argv), environ);
+    err = errno;
+    write(sp->errfd, &err, sizeof(err));
+    _exit(127);
+}
+
+/*
+ * lookup_path - Find the file to exec for command name, the way execvp
+ *    would, and remember the answer (found or not) in pathcache. An entry
+ *    is trusted while $PATH is unchanged and no directory searched to
+ *    find it has been modified since. Names containing a slash are not
+ *    searched for, only checked. Unless upto is NULL, it is raised to the
+ *    last directory the answer depends on. Returns NULL if there is
+ *    nothing to run.
+ */
+const char *lookup_path(const char *name, int *upto) {
+    const char *pathvar = getenv("PATH");
+    struct pathent_t *ent;
+    unsigned b;
+    int i, dir;
+
+    if (strchr(name, '/') != NULL) {
+        return is_executable(name) ? name : NULL;
+    }
+
+    if (pathvar == NULL) {
+        pathvar = "/bin:/usr/bin"; // execvp's default
+    }
+    if (pathcache.pathvar == NULL || strcmp(pathcache.pathvar, pathvar) != 0) {
+        pathcache_reset(pathvar);
+    }
+
+    b = strhash(name, strlen(name)) & (pathcache.cap - 1);
+    while ((ent = &pathcache.ents[b])->name != NULL) {
+        if (strcmp(ent->name, name) == 0) {
+            if (pathcache_fresh(ent->dir)) {
+                ent->hits++;
+                if (upto != NULL && ent->dir > *upto)
+                    *upto = ent->dir;
+                return ent->path;
+            }
+            pathcache_flush(); // a directory changed, any entry may be wrong
+            b = strhash(name, strlen(name)) & (pathcache.cap - 1);
+            break;
+        }
+        b = (b + 1) & (pathcache.cap - 1);
+    }
+
+    if ((pathcache.count + 1) * 2 > pathcache.cap) {
+        struct pathent_t *old = pathcache.ents;
+        int oldcap = pathcache.cap;
+
+        pathcache.ents = calloc(oldcap * 2, sizeof(struct pathent_t));
+        if (pathcache.ents == NULL)
+            unix_error("lookup_path error");
+        pathcache.cap = oldcap * 2;
+        for (i = 0; i < oldcap; i++) {
+            if (old[i].name == NULL)
+                continue;
+            b = strhash(old[i].name, strlen(old[i].name)) & (pathcache.cap - 1);
+            while (pathcache.ents[b].name != NULL)
+                b = (b + 1) & (pathcache.cap - 1);
+            pathcache.ents[b] = old[i];
+        }
+        free(old);
+        b = strhash(name, strlen(name)) & (pathcache.cap - 1);
+        while (pathcache.ents[b].name != NULL)
+            b = (b + 1) & (pathcache.cap - 1);
+    }
+
+    ent = &pathcache.ents[b];
+    ent->path = search_path(name, &dir);
+    ent->name = strdup(name);
+    if (ent->name == NULL)
+        unix_error("lookup_path error");
+    ent->dir = dir;
+    ent->hits = 0;
+    pathcache.count++;
+    if (upto != NULL && dir > *upto)
+        *upto = dir;
+    return ent->path;
+}
+
+/*
+ * search_path - Look for name in each $PATH directory in turn. Returns
+ *    a malloc'd path and sets *dir to the directory's index, or returns
+ *    NULL and sets *dir to the last index if no directory has it.
+ */
+char *search_path(const char *name, int *dir) {
+    char *path;
+    int i;
+
+    for (i = 0; i < pathcache.ndirs; i++) {
+        const char *d = pathcache.dirs[i][0] ? pathcache.dirs[i] : "."; // empty means cwd
+
+        path = malloc(strlen(d) + strlen(name) + 2);
+        if (path == NULL)
+            unix_error("search_path error");
+        sprintf(path, "%s/%s", d, name);
+        if (is_executable(path)) {
+            *dir = i;
+            return path;
+        }
+        free(path);
+    }
+    *dir = pathcache.ndirs - 1;
+    return NULL;
+}
+
+/*
+ * script_argv - Arguments for running path with /bin/sh, which is what
+ *    execvp does with a file the kernel cannot exec (ENOEXEC), such as
+ *    a script without a #! line: /bin/sh, path, then argv[1] on.
+ */
+char **script_argv(const char *path, char **argv) {
+    char **shargv;
+    int n;
+
+    for (n = 1; argv[n - 1] != NULL; n++)
+        ;
+    shargv = arena_alloc(&linearena, (n + 1) * sizeof(char *));
+    shargv[0] = "/bin/sh";
+    shargv[1] = (char *)path;
+    memcpy(shargv + 2, argv + 1, (n - 1) * sizeof(char *));
+    return shargv;
+}
+
+/* is_executable - Is path a regular file we may execute? */
+int is_executable(const char *path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+/*
+ * pathcache_fresh - Check that directories 0..upto have not been modified
+ *    since they were last looked at, i.e. no command was added to or
+ *    removed from them. Records the new mtime of any that have been.
+ */
+int pathcache_fresh(int upto) {
+    struct stat st;
+    int i, fresh = 1;
+
+    for (i = 0; i <= upto; i++) {
+        if (stat(pathcache.dirs[i][0] ? pathcache.dirs[i] : ".", &st) != 0) {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        if (st.st_mtim.tv_sec != pathcache.mtimes[i].tv_sec || st.st_mtim.tv_nsec != pathcache.mtimes[i].tv_nsec) {
+            pathcache.mtimes[i] = st.st_mtim;
+            fresh = 0;
+        }
+    }
+    return fresh;
+}
+
+/*
+ * pathcache_reset - Forget every entry and start over with the
+ *    directories of pathvar.
+ */
+void pathcache_reset(const char *pathvar) {
+    char *p;
+    int i;
+
+    pathcache_flush();
+    free(pathcache.pathvar);
+    if (pathcache.dirs != NULL)
+        free(pathcache.dirs[0]);
+    free(pathcache.dirs);
+    free(pathcache.mtimes);
+
+    pathcache.ndirs = 1;
+    for (p = (char *)pathvar; *p; p++) {
+        if (*p == ':')
+            pathcache.ndirs++;
+    }
+    pathcache.pathvar = strdup(pathvar);
+    pathcache.dirs = malloc(pathcache.ndirs * sizeof(char *));
+    pathcache.mtimes = calloc(pathcache.ndirs, sizeof(struct timespec));
+    p = strdup(pathvar);
+    if (pathcache.pathvar == NULL || pathcache.dirs == NULL || pathcache.mtimes == NULL || p == NULL)
+        unix_error("pathcache_reset error");
+
+    //split in place: every ':' becomes the end of a directory
+    for (i = 0; i < pathcache.ndirs; i++) {
+        pathcache.dirs[i] = p;
+        p = strchr(p, ':');
+        if (p != NULL)
+            *p++ = '\0';
+    }
+    pathcache_fresh(pathcache.ndirs - 1);
+
+    if (pathcache.ents == NULL) {
+        pathcache.cap = 16;
+        pathcache.ents = calloc(pathcache.cap, sizeof(struct pathent_t));
+        if (pathcache.ents == NULL)
+            unix_error("pathcache_reset error");
+    }
+}
+
+/*
+ * pathcache_flush - Forget every remembered lookup. Plans hold looked up
+ *    paths too; get_plan drops them when it sees that gen has moved on.
+ */
+void pathcache_flush(void) {
+    int i;
+
+    pathcache.gen++;
+    for (i = 0; i < pathcache.cap; i++) {
+        free(pathcache.ents[i].name);
+        free(pathcache.ents[i].path);
+        pathcache.ents[i].name = NULL;
+        pathcache.ents[i].path = NULL;
+    }
+    pathcache.count = 0;
+}
+
+/*
+ * do_hash - Execute the builtin hash command. With no arguments list
+ *    the remembered commands and how often each was reused, with -r
+ *    forget them (and every cached plan), with -s show the plan cache's
+ *    counters, otherwise look up each name given so that later commands
+ *    find it remembered.
+ */
+int do_hash(char **argv) {
+    struct pathent_t *ent;
+    int i, status = 0;
+
+    if (argv[1] == NULL) {
+        if (pathcache.count == 0) {
+            printf("hash: hash table empty\n");
+            return 0;
+        }
+        printf("hits\tcommand\n");
+        for (i = 0; i < pathcache.cap; i++) {
+            ent = &pathcache.ents[i];
+            if (ent->name == NULL)
+                continue;
+            if (ent->path != NULL)
+                printf("%4d\t%s\n", ent->hits, ent->path);
+            else
+                printf("%4d\t%s (not found)\n", ent->hits, ent->name);
+        }
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-r") == 0) {
+        pathcache_flush(); // the plan being run stays until the next line
+        return 0;
+    }
+
+    if (strcmp(argv[1], "-s") == 0) {
+        printf("plans: %d of %d cached, %ld hits, %ld misses\n", plans.count, plans.max, plans.hits, plans.misses);
+        return 0;
+    }
+
+    for (i = 1; argv[i] != NULL; i++) {
+        if (lookup_path(argv[i], NULL) == NULL) {
+            printf("hash: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/*
+ * parse_line - Build the syntax tree for cmdline in arena:
+ *
+ *    list     := andor { (';' | '&') andor } [';' | '&']
+ *    andor    := pipeline { ('&&' | '||') pipeline }
+ *    pipeline := command { '|' command }
+ *    command  := '(' list ')' { redir } | (word | redir) { word | redir }
+ *    redir    := ('<' | '>') word
+ *
+ * Returns NULL for a blank line, or after reporting a syntax error.
+ */
+struct node_t *parse_line(const char *cmdline, struct arena_t *arena) {
+    struct parser_t p;
+    struct node_t *root;
+
+    p.line = cmdline;
+    p.arena = arena;
+    p.error = 0;
+    lex_init(&p.lx, cmdline);
+    next_token(&p);
+
+    root = parse_list(&p);
+    if (!p.error && p.tok.type != T_END) {
+        syntax_error(&p); // a stray )
+    }
+    if (p.error || root == NULL) {
+        return NULL;
+    }
+
+    //a line that is a single job is known by its whole text, spaces and all
+    if (root->type != N_SEQ) {
+        root->start = 0;
+        root->end = strlen(cmdline);
+    }
+    return root;
+}
+
+/* parse_list - list := andor { (';' | '&') andor } [';' | '&'] */
+struct node_t *parse_list(struct parser_t *p) {
+    struct node_t *list = NULL, *item, *seq;
+
+    while (p->tok.type != T_END && p->tok.type != T_RPAREN) {
+        if ((item = parse_andor(p)) == NULL)
+            return NULL;
+        if (p->tok.type == T_AMP) {
+            struct node_t *bg = new_node(p, N_BG, item->start);
+            bg->left = item;
+            bg->end = p->tok.end;
+            item = bg;
+            next_token(p);
+        } else if (p->tok.type == T_SEMI) {
+            next_token(p);
+        } else if (p->tok.type != T_END && p->tok.type != T_RPAREN) {
+            syntax_error(p);
+            return NULL;
+        }
+
+        if (list == NULL) {
+            list = item;
+        } else {
+            seq = new_node(p, N_SEQ, list->start);
+            seq->left = list;
+            seq->right = item;
+            seq->end = item->end;
+            list = seq;
+        }
+    }
+    return list;
+}
+
+/* parse_andor - andor := pipeline { ('&&' | '||') pipeline } */
+struct node_t *parse_andor(struct parser_t *p) {
+    struct node_t *left, *right, *op;
+    int type;
+
+    if ((left = parse_pipeline(p)) == NULL)
+        return NULL;
+    while (p->tok.type == T_AND || p->tok.type == T_OR) {
+        type = (p->tok.type == T_AND) ? N_AND : N_OR;
+        next_token(p);
+        if ((right = parse_pipeline(p)) == NULL)
+            return NULL;
+        op = new_node(p, type, left->start);
+        op->left = left;
+        op->right = right;
+        op->end = right->end;
+        left = op;
+    }
+    return left;
+}
+
+/* parse_pipeline - pipeline := command { '|' command } */
+struct node_t *parse_pipeline(struct parser_t *p) {
+    struct node_t *first, *last, *pipe;
+
+    if ((first = parse_command(p)) == NULL)
+        return NULL;
+    if (p->tok.type != T_PIPE)
+        return first;
+
+    pipe = new_node(p, N_PIPE, first->start);
+    pipe->left = first;
+    pipe->nstages = 1;
+    last = first;
+    while (p->tok.type == T_PIPE) {
+        next_token(p);
+        if ((last->next = parse_command(p)) == NULL)
+            return NULL;
+        last = last->next;
+        pipe->nstages++;
+    }
+    pipe->end = last->end;
+    return pipe;
+}
+
+/*
+ * parse_command - command := '(' list ')' { redir }
+ *                          | (word | redir) { word | redir }
+ */
+struct node_t *parse_command(struct parser_t *p) {
+    struct node_t *cmd;
+    struct lexer_t ahead;
+    struct token_t tok;
+    int argc, prev;
+
+    if (p->tok.type == T_LPAREN) {
+        cmd = new_node(p, N_SUBSHELL, p->tok.start);
+        next_token(p);
+        cmd->left = parse_list(p);
+        if (p->error)
+            return NULL;
+        if (cmd->left == NULL || p->tok.type != T_RPAREN) {
+            syntax_error(p);
+            return NULL;
+        }
+        cmd->end = p->tok.end;
+        next_token(p);
+        while (p->tok.type == T_IN || p->tok.type == T_OUT) {
+            if (!parse_redirection(p, cmd))
+                return NULL;
+        }
+        return cmd;
+    }
+
+    if (p->tok.type != T_WORD && p->tok.type != T_IN && p->tok.type != T_OUT) {
+        syntax_error(p);
+        return NULL;
+    }
+
+    //count the words first with a second tokenizer, so argv is allocated
+    //at its exact size
+    argc = 0;
+    prev = T_END;
+    ahead = p->lx;
+    tok = p->tok;
+    while (tok.type == T_WORD || tok.type == T_IN || tok.type == T_OUT) {
+        if (tok.type == T_WORD && prev != T_IN && prev != T_OUT)
+            argc++;
+        prev = tok.type;
+        if (!lex_next(&ahead, &tok))
+            tok.type = T_END;
+    }
+
+    cmd = new_node(p, N_CMD, p->tok.start);
+    cmd->argv = arena_alloc(p->arena, (argc + 1) * sizeof(char *));
+    argc = 0;
+    while (p->tok.type == T_WORD || p->tok.type == T_IN || p->tok.type == T_OUT) {
+        if (p->tok.type == T_WORD) {
+            char *arg = arena_alloc(p->arena, p->tok.len + 1);
+
+            memcpy(arg, p->line + p->tok.off, p->tok.len);
+            arg[p->tok.len] = '\0';
+            cmd->argv[argc++] = arg;
+            cmd->end = p->tok.end;
+            next_token(p);
+        } else if (!parse_redirection(p, cmd)) {
+            return NULL;
+        }
+    }
+    cmd->argv[argc] = NULL;
+    return cmd;
+}
+
+/* parse_redirection - redir := ('<' | '>') word, recorded in node */
+int parse_redirection(struct parser_t *p, struct node_t *node) {
+    int type = p->tok.type;
+    char *file;
+
+    next_token(p);
+    if (p->tok.type != T_WORD) {
+        syntax_error(p);
+        return 0;
+    }
+    file = arena_alloc(p->arena, p->tok.len + 1);
+    memcpy(file, p->line + p->tok.off, p->tok.len);
+    file[p->tok.len] = '\0';
+    if (type == T_IN)
+        node->infile = file;
+    else
+        node->outfile = file;
+    node->end = p->tok.end;
+    next_token(p);
+    return 1;
+}
+
+/* new_node - Allocate a node of the given type, starting at start */
+struct node_t *new_node(struct parser_t *p, int type, int start) {
+    struct node_t *node = arena_alloc(p->arena, sizeof(struct node_t));
+
+    memset(node, 0, sizeof(struct node_t));
+    node->type = type;
+    node->start = start;
+    node->end = start;
+    return node;
+}
+
+/* next_token - Move the parser on to the next token */
+void next_token(struct parser_t *p) {
+    if (!lex_next(&p->lx, &p->tok)) {
+        p->tok.type = T_END;
+        p->tok.start = p->tok.end = p->lx.pos;
+    }
+}
+
+/* syntax_error - Report the token the parser could not make sense of */
+void syntax_error(struct parser_t *p) {
+    if (p->error)
+        return;
+    p->error = 1;
+    if (p->tok.type == T_END)
+        printf("syntax error near end of line\n");
+    else
+        printf("syntax error near '%.*s'\n", p->tok.end - p->tok.start, p->line + p->tok.start);
+}
+
+/* lex_init - Start splitting buf into tokens */
+void lex_init(struct lexer_t *lx, const char *buf) {
+    lx->buf = buf;
+    lx->pos = 0;
+}
+
+/*
+ * lex_next - Find the next token of the line, as a slice of it: one of
+ *    the operators | || & && ; ( ) < >, a run of bytes up to a space, an
+ *    operator or the end of the line, or the bytes between a pair of
+ *    single quotes. Returns 0 when there are no more tokens. A quote that
+ *    is never closed ends the line, as it always has.
+ */
+int lex_next(struct lexer_t *lx, struct token_t *tok) {
+    const char *buf = lx->buf;
+    int pos, end;
+
+    pos = lx->pos;
+    if (buf[pos] == ' ' && buf[++pos] == ' ') /* ignore spaces */
+        pos = scan(buf, pos, BC_ALL & ~BC_SPACE);
+    if (bclass[(unsigned char)buf[pos]] & BC_END) {
+        lx->pos = pos;
+        return 0;
+    }
+
+    tok->type = T_WORD;
+    tok->start = pos;
+    if (buf[pos] == '\'') {
+        pos++;
+        end = scan(buf, pos, BC_QUOTE);
+        if (buf[end] != '\'') {
+            lx->pos = end;
+            return 0;
+        }
+        lx->pos = end + 1;
+    }
+    else if (bclass[(unsigned char)buf[pos]] & BC_OP) {
+        end = pos + 1;
+        switch (buf[pos]) {
+            case '|': tok->type = T_PIPE; break;
+            case '&': tok->type = T_AMP; break;
+            case ';': tok->type = T_SEMI; break;
+            case '(': tok->type = T_LPAREN; break;
+            case ')': tok->type = T_RPAREN; break;
+            case '<': tok->type = T_IN; break;
+            case '>': tok->type = T_OUT; break;
+        }
+        if ((buf[pos] == '|' || buf[pos] == '&') && buf[pos+1] == buf[pos]) {
+            tok->type = (buf[pos] == '|') ? T_OR : T_AND;
+            end++;
+        }
+        lx->pos = end;
+    }
+    else {
+        end = scan(buf, pos, BC_SPACE | BC_OP);
+        lx->pos = end;
+    }
+    tok->end = lx->pos;
+
+    tok->off = pos;
+    tok->len = end - pos;
+    return 1;
+}
+
+/*
+ * init_scan - Fill in bclass and choose the scan routine: AVX2 or SSE2
+ *    when the CPU has them, plain C otherwise. TSH_SCAN=scalar, sse2 or
+ *    avx2 forces one, which is handy for comparing them.
+ */
+void init_scan(void) {
+    const char *force = getenv("TSH_SCAN");
+    int c;
+
+    for (c = 0; c < 256; c++)
+        bclass[c] = BC_WORD;
+    bclass[' '] = BC_SPACE;
+    bclass['\''] = BC_QUOTE;
+    bclass['|'] = bclass['<'] = bclass['>'] = bclass['&'] = BC_OP;
+    bclass[';'] = bclass['('] = bclass[')'] = BC_OP;
+    bclass['\n'] = bclass['\0'] = BC_END;
+
+    scan = scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (force == NULL || strcmp(force, "avx2") == 0))
+        scan = scan_avx2;
+    else if (__builtin_cpu_supports("sse2") && (force == NULL || strcmp(force, "sse2") == 0))
+        scan = scan_sse2;
+#endif
+    if (verbose)
+        printf("scan: %s\n", scan == scan_scalar ? "scalar" : scan == scan_sse2 ? "sse2" : "avx2");
+}
+
+/*
+ * scan_scalar - Return the offset of the first byte at or after pos in
+ *    buf whose class is in stop (or BC_END, which always stops).
+ */
+int scan_scalar(const char *buf, int pos, int stop) {
+    stop |= BC_END;
+    while (!(bclass[(unsigned char)buf[pos]] & stop))
+        pos++;
+    return pos;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * scan_sse2 - scan_scalar 16 bytes at a time. Most words are short, so
+ *    the first few bytes are still checked one at a time. Loads are
+ *    aligned, so they never cross into a page past the end of the line;
+ *    the bytes before pos in the first block are masked off. Those reads
+ *    outside the line are deliberate, so ASan is told not to check them.
+ */
+__attribute__((target("sse2"), no_sanitize_address))
+int scan_sse2(const char *buf, int pos, int stop) {
+    const char *p;
+    const __m128i *blk;
+    unsigned bits;
+    __m128i v, hit, any;
+    int i;
+
+    for (i = 0; i < 8; i++, pos++) {
+        if (bclass[(unsigned char)buf[pos]] & (stop | BC_END))
+            return pos;
+    }
+    p = buf + pos;
+    blk = (const __m128i *)((uintptr_t)p & ~(uintptr_t)15);
+    bits = ~0u << (p - (const char *)blk);
+
+    while (1) {
+        v = _mm_load_si128(blk);
+        any = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                           _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        hit = any;
+        if (stop & (BC_SPACE | BC_WORD)) {
+            __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+            any = _mm_or_si128(any, sp);
+            if (stop & BC_SPACE)
+                hit = _mm_or_si128(hit, sp);
+        }
+        if (stop & (BC_QUOTE | BC_WORD)) {
+            __m128i q = _mm_cmpeq_epi8(v, _mm_set1_epi8('\''));
+            any = _mm_or_si128(any, q);
+            if (stop & BC_QUOTE)
+                hit = _mm_or_si128(hit, q);
+        }
+        if (stop & (BC_OP | BC_WORD)) {
+            __m128i op = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')),
+                                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')),
+                                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('&'))));
+            //( is 0x28 and ) is 0x29, so one compare finds both
+            op = _mm_or_si128(op, _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(';')),
+                                               _mm_cmpeq_epi8(_mm_or_si128(v, _mm_set1_epi8(1)), _mm_set1_epi8(')'))));
+            any = _mm_or_si128(any, op);
+            if (stop & BC_OP)
+                hit = _mm_or_si128(hit, op);
+        }
+        //bytes in no other class are words
+        if (stop & BC_WORD)
+            hit = _mm_or_si128(hit, _mm_andnot_si128(any, _mm_set1_epi8(-1)));
+
+        bits &= _mm_movemask_epi8(hit);
+        if (bits != 0)
+            return (const char *)blk - buf + __builtin_ctz(bits);
+        bits = ~0u;
+        blk++;
+    }
+}
+
+/* scan_avx2 - scan_sse2 32 bytes at a time */
+__attribute__((target("avx2"), no_sanitize_address))
+int scan_avx2(const char *buf, int pos, int stop) {
+    const char *p;
+    const __m256i *blk;
+    unsigned bits;
+    __m256i v, hit, any;
+    int i;
+
+    for (i = 0; i < 8; i++, pos++) {
+        if (bclass[(unsigned char)buf[pos]] & (stop | BC_END))
+            return pos;
+    }
+    p = buf + pos;
+    blk = (const __m256i *)((uintptr_t)p & ~(uintptr_t)31);
+    bits = ~0u << (p - (const char *)blk);
+
+    while (1) {
+        v = _mm256_load_si256(blk);
+        any = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                              _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        hit = any;
+        if (stop & (BC_SPACE | BC_WORD)) {
+            __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+            any = _mm256_or_si256(any, sp);
+            if (stop & BC_SPACE)
+                hit = _mm256_or_si256(hit, sp);
+        }
+        if (stop & (BC_QUOTE | BC_WORD)) {
+            __m256i q = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\''));
+            any = _mm256_or_si256(any, q);
+            if (stop & BC_QUOTE)
+                hit = _mm256_or_si256(hit, q);
+        }
+        if (stop & (BC_OP | BC_WORD)) {
+            __m256i op = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')),
+                                                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'))),
+                                         _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')),
+                                                         _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&'))));
+            op = _mm256_or_si256(op, _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')),
+                                                     _mm256_cmpeq_epi8(_mm256_or_si256(v, _mm256_set1_epi8(1)), _mm256_set1_epi8(')'))));
+            any = _mm256_or_si256(any, op);
+            if (stop & BC_OP)
+                hit = _mm256_or_si256(hit, op);
+        }
+        if (stop & BC_WORD)
+            hit = _mm256_or_si256(hit, _mm256_andnot_si256(any, _mm256_set1_epi8(-1)));
+
+        bits &= _mm256_movemask_epi8(hit);
+        if (bits != 0)
+            return (const char *)blk - buf + __builtin_ctz(bits);
+        bits = ~0u;
+        blk++;
+    }
+}
+#else
+int scan_sse2(const char *buf, int pos, int stop) {
+    return scan_scalar(buf, pos, stop);
+}
+
+int scan_avx2(const char *buf, int pos, int stop) {
+    return scan_scalar(buf, pos, stop);
+}
+#endif
+
+/*
+ * arena_alloc - Allocate n bytes from arena. Blocks are only added, never
+ *    freed, so once the arena has seen its largest line it stops calling
+ *    malloc altogether.
+ */
+void *arena_alloc(struct arena_t *arena, size_t n) {
+    struct chunk_t *c;
+    size_t cap;
+    void *p;
+
+    n = (n + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    while (arena->cur == NULL || arena->used + n > arena->cur->cap) {
+        if (arena->cur != NULL && arena->cur->next != NULL) {
+            arena->cur = arena->cur->next;
+            arena->used = 0;
+            continue;
+        }
+
+        cap = ARENACHUNK;
+        if (arena->cur != NULL && arena->cur->cap * 2 > cap)
+            cap = arena->cur->cap * 2;
+        while (cap < n)
+            cap *= 2;
+        c = malloc(sizeof(struct chunk_t) + cap);
+        if (c == NULL)
+            unix_error("arena_alloc error");
+        c->next = NULL;
+        c->cap = cap;
+        if (arena->cur != NULL)
+            arena->cur->next = c;
+        else
+            arena->first = c;
+        arena->cur = c;
+        arena->used = 0;
+    }
+
+    p = arena->cur->data + arena->used;
+    arena->used += n;
+    return p;
+}
+
+/* arena_reset - Release everything allocated from arena at once */
+void arena_reset(struct arena_t *arena) {
+    arena->cur = arena->first;
+    arena->used = 0;
+}
+
+/* arena_free - Give all of arena's memory back */
+void arena_free(struct arena_t *arena) {
+    struct chunk_t *c, *next;
+
+    for (c = arena->first; c != NULL; c = next) {
+        next = c->next;
+        free(c);
+    }
+    arena->first = arena->cur = NULL;
+    arena->used = 0;
+}
+
+/*
+ * init_plans - Size the plan cache: TSH_PLANS lines, MAXPLANS if unset,
+ *    0 to parse every line afresh.
+ */
+void init_plans(void) {
+    const char *env = getenv("TSH_PLANS");
+
+    plans.max = env ? atoi(env) : MAXPLANS;
+    if (plans.max <= 0) {
+        plans.max = 0;
+        return;
+    }
+    for (plans.nbuckets = 16; plans.nbuckets < 2 * plans.max; plans.nbuckets *= 2)
+        ;
+    plans.buckets = calloc(plans.nbuckets, sizeof(struct plan_t *));
+    if (plans.buckets == NULL)
+        unix_error("init_plans error");
+}
+
+/*
+ * get_plan - Return the syntax tree for cmdline, with the executables
+ *    already looked up, from the plan cache if it has been seen before.
+ *    Plans are dropped when $PATH or the current directory changes, when
+ *    the PATH cache has been flushed (hash -r, or a directory changed),
+ *    and when a directory one of their commands was looked up in has
+ *    changed. That only happens here, never while eval runs a plan.
+ *    Commands named by a path are not covered by these checks, which
+ *    is why resolve_plan never caches them as missing.
+ *    Returns NULL for a blank line or a syntax error; those are never
+ *    cached, so an error is reported every time.
+ */
+struct node_t *get_plan(const char *cmdline) {
+    const char *pathvar = getenv("PATH");
+    struct plan_t *plan;
+    struct node_t *root;
+    struct arena_t arena = { NULL, NULL, 0 };
+    struct stat st;
+    unsigned h;
+    int len, upto;
+
+    if (plans.max == 0) {
+        return parse_line(cmdline, &linearena);
+    }
+
+    if (pathvar == NULL)
+        pathvar = "";
+    if (stat(".", &st) != 0)
+        st.st_dev = st.st_ino = 0;
+    if (plans.pathvar == NULL || strcmp(plans.pathvar, pathvar) != 0 || st.st_dev != plans.dev || st.st_ino != plans.ino) {
+        plans_flush();
+        free(plans.pathvar);
+        if ((plans.pathvar = strdup(pathvar)) == NULL)
+            unix_error("get_plan error");
+        plans.dev = st.st_dev;
+        plans.ino = st.st_ino;
+    }
+    if (plans.gen != pathcache.gen) {
+        plans_flush();
+        plans.gen = pathcache.gen;
+    }
+
+    len = strlen(cmdline);
+    h = strhash(cmdline, len);
+    for (plan = plans.buckets[h & (plans.nbuckets - 1)]; plan != NULL; plan = plan->chain) {
+        if (plan->hash == h && strcmp(plan->line, cmdline) == 0)
+            break;
+    }
+    //the same check lookup_path makes before trusting an entry
+    if (plan != NULL && plan->upto >= 0 && !pathcache_fresh(plan->upto)) {
+        pathcache_flush();
+        plans_flush();
+        plans.gen = pathcache.gen;
+        plan = NULL;
+    }
+    if (plan != NULL) {
+        plans.hits++;
+        if (plan != plans.head) {
+            plans_unlink(plan);
+            plan->next = plans.head;
+            plans.head->prev = plan;
+            plans.head = plan;
+        }
+        return plan->root;
+    }
+
+    plans.misses++;
+    root = parse_line(cmdline, &arena);
+    if (root == NULL) {
+        arena_free(&arena);
+        return NULL;
+    }
+    upto = -1;
+    resolve_plan(root, &arena, &upto);
+
+    if (plans.count == plans.max) {
+        plans_drop(plans.tail);
+    }
+    plan = arena_alloc(&arena, sizeof(struct plan_t));
+    plan->line = arena_alloc(&arena, len + 1);
+    memcpy(plan->line, cmdline, len + 1);
+    plan->hash = h;
+    plan->root = root;
+    plan->upto = upto;
+    plan->arena = arena; // the plan lives in its own arena
+    plan->prev = NULL;
+    plan->next = plans.head;
+    if (plans.head != NULL)
+        plans.head->prev = plan;
+    plans.head = plan;
+    if (plans.tail == NULL)
+        plans.tail = plan;
+    plan->chain = plans.buckets[h & (plans.nbuckets - 1)];
+    plans.buckets[h & (plans.nbuckets - 1)] = plan;
+    plans.count++;
+    return root;
+}
+
+/*
+ * resolve_plan - Look up the executable of every simple command under
+ *    node and keep a copy of the path in arena. *upto is raised to the
+ *    last PATH directory looked at, for get_plan to check on later hits.
+ *    A command not found along PATH is kept as "", which those checks
+ *    drop once it is installed. A path name that is not there yet is
+ *    left NULL for spawn_proc to check every time, since no directory
+ *    recorded in upto would tell us when it appears.
+ */
+void resolve_plan(struct node_t *node, struct arena_t *arena, int *upto) {
+    const struct builtin_t *bi;
+    const char *path;
+
+    for (; node != NULL; node = node->next) {
+        //stage builtins are exec'ed when they run alone, so they need a path
+        if (node->type == N_CMD && node->argv[0] != NULL &&
+            ((bi = find_builtin(node->argv[0])) == NULL || bi->kind >= BI_STAGE)) {
+            //remember a miss along PATH too, so spawn_proc does not look
+            //again; get_plan drops it when a directory changes. A name
+            //with a slash is not searched for and nothing would tell us
+            //it appeared, so a miss there is left to spawn_proc
+            path = lookup_path(node->argv[0], upto);
+            if (path == NULL && strchr(node->argv[0], '/') == NULL)
+                path = "";
+            if (path != NULL) {
+                node->path = arena_alloc(arena, strlen(path) + 1);
+                strcpy(node->path, path);
+            }
+        }
+        resolve_plan(node->left, arena, upto);
+        resolve_plan(node->right, arena, upto);
+    }
+}
+
+/* plans_flush - Drop every cached plan */
+void plans_flush(void) {
+    while (plans.head != NULL) {
+        plans_drop(plans.head);
+    }
+}
+
+/* plans_drop - Remove plan from the cache and free it */
+void plans_drop(struct plan_t *plan) {
+    struct plan_t **pp = &plans.buckets[plan->hash & (plans.nbuckets - 1)];
+    struct arena_t arena = plan->arena; // plan itself lives in the arena
+
+    while (*pp != plan)
+        pp = &(*pp)->chain;
+    *pp = plan->chain;
+    plans_unlink(plan);
+    plans.count--;
+    arena_free(&arena);
+}
+
+/* plans_unlink - Take plan out of the LRU list */
+void plans_unlink(struct plan_t *plan) {
+    if (plan->prev != NULL)
+        plan->prev->next = plan->next;
+    else
+        plans.head = plan->next;
+    if (plan->next != NULL)
+        plan->next->prev = plan->prev;
+    else
+        plans.tail = plan->prev;
+    plan->prev = plan->next = NULL;
+}
+
+/* The builtins, looked up by find_builtin */
+const struct builtin_t builtins[] = {
+    { "quit",   do_quit,   BI_SHELL, NULL }, // Exit the shell
+    { "jobs",   do_jobs,   BI_SHELL, NULL }, // List all background jobs
+    { "bg",     do_bgfg,   BI_SHELL, NULL }, // Execute bg or fg command
+    { "fg",     do_bgfg,   BI_SHELL, NULL },
+    { "hash",   do_hash,   BI_SHELL, NULL }, // List, clear or fill the PATH cache
+    { "echo",   do_echo,   BI_UTIL,  NULL }, // The rest save a fork and exec
+    { "true",   do_true,   BI_UTIL,  NULL },
+    { "false",  do_false,  BI_UTIL,  NULL },
+    { "test",   do_test,   BI_UTIL,  NULL },
+    { "[",      do_test,   BI_UTIL,  NULL },
+    { "printf", do_printf, BI_UTIL,  NULL },
+    { "tee",    do_tee,    BI_STAGE, tee_plain }, // Fans a pipe out without copying
+    { "cat",    do_cat,    BI_COPY,  cat_plain }, // Copies inside the kernel
+    { NULL,     NULL,      0,        NULL }
+};
+
+/*
+ * find_builtin - Look name up in builtins. Utilities are also found by
+ *    their usual paths, so /bin/echo runs the builtin echo.
+ */
+const struct builtin_t *find_builtin(const char *name) {
+    const struct builtin_t *bi;
+    int util = 0;
+
+    if (name[0] == '/') {
+        if (strncmp(name, "/bin/", 5) == 0)
+            name += 5;
+        else if (strncmp(name, "/usr/bin/", 9) == 0)
+            name += 9;
+        else
+            return NULL;
+        util = 1;
+    }
+    for (bi = builtins; bi->name != NULL; bi++) {
+        if (bi->name[0] == name[0] && strcmp(bi->name, name) == 0)
+            return (util && bi->kind == BI_SHELL) ? NULL : bi;
+    }
+    return NULL;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately. Returns its exit status, or -1 if argv[0] is not a
+ *    builtin.
+ */
+int builtin_cmd(char **argv) {
+    const struct builtin_t *bi = find_builtin(argv[0]);
+
+    if (bi == NULL) {
+        return -1;
+    }
+    return bi->fn(argv);
+}
+
+/*
+ * run_builtin - Run a builtin in the shell process. Its redirections are
+ *    applied to the shell's own stdin and stdout, which are saved first
+ *    and put back afterwards.
+ */
+int run_builtin(struct node_t *node) {
+    int saved_in = -1, saved_out = -1;
+    int fd, status;
+
+    fflush(stdout);
+    if (node->infile != NULL) {
+        if ((fd = open(node->infile, O_RDONLY, 0)) < 0) {
+            printf("%s: %s\n", node->infile, strerror(errno));
+            return 1;
+        }
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (node->outfile != NULL) {
+        if ((fd = open(node->outfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) < 0) {
+            printf("%s: %s\n", node->outfile, strerror(errno));
+            status = 1;
+            goto restore;
+        }
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+
+    status = builtin_cmd(node->argv);
+    fflush(stdout);
+
+restore:
+    if (saved_in != -1) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    if (saved_out != -1) {
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    return status;
+}
+
+/* do_quit - Execute the builtin quit command */
+int do_quit(char **argv) {
+    exit(0);
+}
+
+/* do_jobs - Execute the builtin jobs command */
+int do_jobs(char **argv) {
+    listjobs(&jobs);
+    return 0;
+}
+
+/* do_true, do_false - Execute the builtin true and false commands */
+int do_true(char **argv) {
+    return 0;
+}
+
+int do_false(char **argv) {
+    return 1;
+}
+
+/*
+ * do_echo - Execute the builtin echo command, like GNU echo: leading
+ *    -n, -e and -E options (also combined, as in -ne), and with -e the
+ *    backslash escapes of print_escapes.
+ */
+int do_echo(char **argv) {
+    int newline = 1, escapes = 0;
+    int i = 1;
+    const char *p;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (p = argv[i] + 1; *p == 'n' || *p == 'e' || *p == 'E'; p++)
+            ;
+        if (*p != '\0')
+            break; // not an option after all, print it
+        for (p = argv[i] + 1; *p; p++) {
+            if (*p == 'n')
+                newline = 0;
+            else
+                escapes = (*p == 'e');
+        }
+    }
+
+    for (; argv[i] != NULL; i++) {
+        if (escapes) {
+            if (print_escapes(argv[i], ESC_ECHO))
+                return 0; // \c: no more output at all
+        } else {
+            fputs(argv[i], stdout);
+        }
+        if (argv[i+1] != NULL)
+            putchar(' ');
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/*
+ * print_escapes - Print s with its backslash escapes interpreted: \\ \a
+ *    \b \c \e \f \n \r \t \v, \xHH, and octal \NNN (for ESC_ECHO also
+ *    \0NNN). Returns 1 if \c asked for output to stop there.
+ */
+int print_escapes(const char *s, int mode) {
+    int c, n;
+
+    for (; *s; s++) {
+        if (*s != '\\' || s[1] == '\0') {
+            putchar(*s);
+            continue;
+        }
+        s++;
+        switch (*s) {
+            case '\\': putchar('\\'); break;
+            case 'a': putchar('\a'); break;
+            case 'b': putchar('\b'); break;
+            case 'c': return 1;
+            case 'e': putchar('\033'); break;
+            case 'f': putchar('\f'); break;
+            case 'n': putchar('\n'); break;
+            case 'r': putchar('\r'); break;
+            case 't': putchar('\t'); break;
+            case 'v': putchar('\v'); break;
+            case '"': putchar('"'); break;
+            case 'x':
+                if (!isxdigit((unsigned char)s[1])) {
+                    fputs("\\x", stdout);
+                    break;
+                }
+                for (c = 0, n = 0; n < 2 && isxdigit((unsigned char)s[1]); n++, s++)
+                    c = c * 16 + (isdigit((unsigned char)s[1]) ? s[1] - '0' : tolower((unsigned char)s[1]) - 'a' + 10);
+                putchar(c);
+                break;
+            default:
+                if (*s < '0' || *s > '7') {
+                    putchar('\\');
+                    putchar(*s);
+                    break;
+                }
+                //\0 takes up to three more digits in echo, like GNU echo;
+                //otherwise the digit we are on is the first of three
+                if (mode != ESC_ECHO || *s != '0')
+                    s--;
+                for (c = 0, n = 0; n < 3 && s[1] >= '0' && s[1] <= '7'; n++, s++)
+                    c = c * 8 + s[1] - '0';
+                putchar(c);
+                break;
+        }
+    }
+    return 0;
+}
+
+/*
+ * do_test - Execute the builtin test (and [) command: string and integer
+ *    comparisons, the usual file tests, ! and -a/-o. Returns 0 for true,
+ *    1 for false and 2 for a malformed expression.
+ */
+int do_test(char **argv) {
+    int n;
+
+    for (n = 0; argv[n+1] != NULL; n++)
+        ;
+    if (strcmp(argv[0], "[") == 0) {
+        if (n == 0 || strcmp(argv[n], "]") != 0) {
+            printf("[: missing ']'\n");
+            return 2;
+        }
+        n--;
+    }
+    return test_expr(argv + 1, n);
+}
+
+/* test_expr - Evaluate the n test arguments at args */
+int test_expr(char **args, int n) {
+    struct stat st;
+    long long a, b;
+    int i, l, r;
+
+    //-o binds less tightly than -a, which binds less tightly than the rest
+    for (i = 1; i < n - 1; i++) {
+        if (strcmp(args[i], "-o") == 0) {
+            if ((l = test_expr(args, i)) == 2 || (r = test_expr(args + i + 1, n - i - 1)) == 2)
+                return 2;
+            return (l == 0 || r == 0) ? 0 : 1;
+        }
+    }
+    for (i = 1; i < n - 1; i++) {
+        if (strcmp(args[i], "-a") == 0) {
+            if ((l = test_expr(args, i)) == 2 || (r = test_expr(args + i + 1, n - i - 1)) == 2)
+                return 2;
+            return (l == 0 && r == 0) ? 0 : 1;
+        }
+    }
+
+    if (n == 0)
+        return 1;
+    if (strcmp(args[0], "!") == 0 && n > 1) {
+        r = test_expr(args + 1, n - 1);
+        return r == 2 ? 2 : !r;
+    }
+    if (n == 1)
+        return args[0][0] == '\0';
+    if (n == 3 && strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+        return test_expr(args + 1, 1);
+
+    if (n == 2) {
+        const char *op = args[0], *f = args[1];
+
+        if (strcmp(op, "-n") == 0) return f[0] == '\0';
+        if (strcmp(op, "-z") == 0) return f[0] != '\0';
+        if (strcmp(op, "-h") == 0 || strcmp(op, "-L") == 0)
+            return !(lstat(f, &st) == 0 && S_ISLNK(st.st_mode));
+        if (op[0] == '-' && op[1] != '\0' && op[2] == '\0' && strchr("edfrwxsp", op[1]) != NULL) {
+            if (stat(f, &st) != 0)
+                return 1;
+            switch (op[1]) {
+                case 'e': return 0;
+                case 'd': return !S_ISDIR(st.st_mode);
+                case 'f': return !S_ISREG(st.st_mode);
+                case 'p': return !S_ISFIFO(st.st_mode);
+                case 's': return !(st.st_size > 0);
+                case 'r': return access(f, R_OK) != 0;
+                case 'w': return access(f, W_OK) != 0;
+                case 'x': return access(f, X_OK) != 0;
+            }
+        }
+        printf("test: %s: unary operator expected\n", op);
+        return 2;
+    }
+
+    if (n == 3) {
+        const char *op = args[1];
+
+        if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+            return strcmp(args[0], args[2]) != 0;
+        if (strcmp(op, "!=") == 0)
+            return strcmp(args[0], args[2]) == 0;
+        if (op[0] == '-' && strlen(op) == 3) {
+            if (!test_int(args[0], &a) || !test_int(args[2], &b))
+                return 2;
+            if (strcmp(op, "-eq") == 0) return !(a == b);
+            if (strcmp(op, "-ne") == 0) return !(a != b);
+            if (strcmp(op, "-lt") == 0) return !(a < b);
+            if (strcmp(op, "-le") == 0) return !(a <= b);
+            if (strcmp(op, "-gt") == 0) return !(a > b);
+            if (strcmp(op, "-ge") == 0) return !(a >= b);
+        }
+        printf("test: %s: binary operator expected\n", op);
+        return 2;
+    }
+
+    printf("test: too many arguments\n");
+    return 2;
+}
+
+/* test_int - Parse an integer operand of test, complaining if it isn't one */
+int test_int(const char *s, long long *val) {
+    char *end;
+
+    errno = 0;
+    *val = strtoll(s, &end, 10);
+    while (*end == ' ')
+        end++;
+    if (s[0] == '\0' || *end != '\0' || errno != 0) {
+        printf("test: %s: integer expression expected\n", s);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * do_printf - Execute the builtin printf command: the format is reused
+ *    until the arguments run out, missing arguments count as "" or 0,
+ *    and %b prints its argument with echo -e escapes.
+ */
+int do_printf(char **argv) {
+    char spec[64];
+    const char *fmt, *p, *arg;
+    char **args;
+    int status = 0, used, n;
+    char *end;
+
+    if (argv[1] == NULL) {
+        printf("printf: missing operand\n");
+        return 1;
+    }
+    fmt = argv[1];
+    args = argv + 2;
+
+    do {
+        used = 0;
+        for (p = fmt; *p; p++) {
+            if (*p == '\\') {
+                //one escape at a time, so \c can stop everything
+                char esc[5];
+
+                n = 1;
+                if (p[1] == 'x')
+                    while (n < 3 && isxdigit((unsigned char)p[n+1])) n++;
+                else if (p[1] >= '0' && p[1] <= '7')
+                    while (n < 3 && p[n+1] >= '0' && p[n+1] <= '7') n++;
+                n = (p[1] == '\0') ? 0 : n;
+                memcpy(esc, p, n + 1);
+                esc[n + 1] = '\0';
+                if (print_escapes(esc, ESC_FORMAT))
+                    return status;
+                p += n;
+                continue;
+            }
+            if (*p != '%') {
+                putchar(*p);
+                continue;
+            }
+            if (p[1] == '%') {
+                putchar('%');
+                p++;
+                continue;
+            }
+
+            //copy flags, width and precision into spec, then the conversion
+            n = 0;
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0", *p) && n < 40)
+                spec[n++] = *p++;
+            while (isdigit((unsigned char)*p) && n < 40)
+                spec[n++] = *p++;
+            if (*p == '.') {
+                spec[n++] = *p++;
+                while (isdigit((unsigned char)*p) && n < 40)
+                    spec[n++] = *p++;
+            }
+            while (*p && strchr("hlLqjzt", *p))
+                p++; // length modifiers mean nothing here
+            if (*p == '\0') {
+                printf("printf: %s: missing conversion\n", fmt);
+                return 1;
+            }
+
+            arg = *args ? *args++ : NULL;
+            used |= (arg != NULL);
+            switch (*p) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c': {
+                    long long v = 0;
+
+                    if (*p == 'c') {
+                        spec[n++] = 'c';
+                        spec[n] = '\0';
+                        printf(spec, arg ? arg[0] : '\0');
+                        break;
+                    }
+                    if (arg != NULL && (arg[0] == '\'' || arg[0] == '"')) {
+                        v = (unsigned char)arg[1]; // 'c is the code of c
+                    } else if (arg != NULL) {
+                        errno = 0;
+                        v = (*p == 'd' || *p == 'i') ? strtoll(arg, &end, 0) : (long long)strtoull(arg, &end, 0);
+                        if (end == arg || *end != '\0' || errno != 0) {
+                            printf("printf: '%s': expected a numeric value\n", arg);
+                            status = 1;
+                        }
+                    }
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *p;
+                    spec[n] = '\0';
+                    printf(spec, v);
+                    break;
+                }
+                case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+                    double v = 0;
+
+                    if (arg != NULL) {
+                        v = strtod(arg, &end);
+                        if (end == arg || *end != '\0') {
+                            printf("printf: '%s': expected a numeric value\n", arg);
+                            status = 1;
+                        }
+                    }
+                    spec[n++] = *p;
+                    spec[n] = '\0';
+                    printf(spec, v);
+                    break;
+                }
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    printf(spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    if (arg != NULL && print_escapes(arg, ESC_ECHO))
+                        return status;
+                    break;
+                default:
+                    printf("printf: %%%c: invalid conversion\n", *p);
+                    return 1;
+            }
+        }
+    } while (used && *args != NULL);
+
+    return status;
+}
+
+/*
+ * do_tee - Execute the builtin tee command, as a pipeline stage: copy
+ *    stdin to stdout and to each file, truncated, or appended to with -a.
+ *    -i ignores SIGINT. Any other option has tee exec'ed, see tee_plain.
+ *    When stdin is a pipe and every output is a pipe
+ *    or a regular file, the data is duplicated with tee(2) and moved
+ *    with splice(2) and never passes through our memory; anything else
+ *    is copied with read and write. With -v the shell reports the bytes
+ *    moved.
+ */
+int do_tee(char **argv) {
+    int append = 0, status = 0, n = 0, i;
+    long long moved;
+    int *outs;
+
+    for (i = 1; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        for (const char *o = argv[i] + 1; *o; o++) {
+            if (*o == 'a') {
+                append = 1;
+            } else if (*o == 'i') {
+                signal(SIGINT, SIG_IGN);
+            } else {
+                printf("tee: invalid option -- '%c'\n", *o);
+                return 1;
+            }
+        }
+    }
+
+    for (n = 0; argv[i + n] != NULL; n++)
+        ;
+    outs = malloc((n + 1) * sizeof(int));
+    if (outs == NULL) {
+        printf("tee: %s\n", strerror(errno));
+        return 1;
+    }
+    for (n = 0; argv[i] != NULL; i++) {
+        outs[n] = open(argv[i], O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if (outs[n] < 0) {
+            printf("tee: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        n++;
+    }
+    outs[n++] = STDOUT_FILENO;
+    fflush(stdout);
+
+    moved = tee_splice(outs, n, &status);
+    if (moved < 0)
+        moved = tee_copy(outs, n, &status);
+    if (verbose)
+        fprintf(stderr, "tee: %lld bytes to %d outputs\n", moved, n);
+
+    for (i = 0; i < n - 1; i++)
+        close(outs[i]);
+    free(outs);
+    return status;
+}
+
+/* tee_plain - Whether do_tee can run tee argv: its only options are -a and -i */
+int tee_plain(char **argv) {
+    for (argv++; *argv != NULL && (*argv)[0] == '-' && (*argv)[1] != '\0'; argv++) {
+        if (strcmp(*argv, "--") == 0)
+            break;
+        if ((*argv)[strspn(*argv + 1, "ai") + 1] != '\0')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * tee_splice - The zero-copy half of do_tee. Each round, tee(2) gives
+ *    every output but the last its own copy of what is in stdin, in a
+ *    private pipe as big as stdin's so that it always takes all of it;
+ *    then the data itself is spliced to the last output and each copy
+ *    to its file. Returns the bytes moved, or -1 without touching stdin
+ *    if the descriptors do not allow it. splice refuses files opened for
+ *    appending, and finding out half way would lose what tee(2) already
+ *    took, so every output, stdout too, is checked first.
+ */
+long long tee_splice(int *outs, int n, int *status) {
+    struct stat st;
+    long long total = 0;
+    int (*mids)[2];
+    ssize_t len, got;
+    int size, i;
+
+    if (fstat(STDIN_FILENO, &st) < 0 || !S_ISFIFO(st.st_mode))
+        return -1;
+    for (i = 0; i < n; i++) {
+        if (fstat(outs[i], &st) < 0 || !(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode)) ||
+            (fcntl(outs[i], F_GETFL) & O_APPEND))
+            return -1;
+    }
+    size = fcntl(STDIN_FILENO, F_GETPIPE_SZ);
+    mids = malloc(n * sizeof(*mids));
+    if (size <= 0 || mids == NULL)
+        return -1;
+    for (i = 0; i < n - 1; i++) {
+        if (pipe2(mids[i], O_CLOEXEC) < 0)
+            break;
+        if (fcntl(mids[i][1], F_SETPIPE_SZ, size) < size) {
+            close(mids[i][0]);
+            close(mids[i][1]);
+            break;
+        }
+    }
+    if (i < n - 1) {
+        while (--i >= 0) {
+            close(mids[i][0]);
+            close(mids[i][1]);
+        }
+        free(mids);
+        return -1;
+    }
+
+    while (1) {
+        if (n > 1)
+            len = tee(STDIN_FILENO, mids[0][1], size, 0);
+        else
+            len = splice(STDIN_FILENO, NULL, outs[0], NULL, size, SPLICE_F_MOVE);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (len < 0) {
+                printf("tee: %s\n", strerror(errno));
+                *status = 1;
+            }
+            break;
+        }
+        if (n > 1) {
+            for (i = 1; i < n - 1; i++) {
+                while ((got = tee(STDIN_FILENO, mids[i][1], len, 0)) < 0 && errno == EINTR)
+                    ;
+                if (got != len)
+                    break;
+            }
+            if (i < n - 1 || splice_all(STDIN_FILENO, outs[n - 1], len) < 0) {
+                printf("tee: %s\n", strerror(errno));
+                *status = 1;
+                break;
+            }
+            for (i = 0; i < n - 1; i++) {
+                if (splice_all(mids[i][0], outs[i], len) < 0) {
+                    printf("tee: %s\n", strerror(errno));
+                    *status = 1;
+                    break;
+                }
+            }
+            if (i < n - 1)
+                break;
+        }
+        total += len;
+    }
+
+    for (i = 0; i < n - 1; i++) {
+        close(mids[i][0]);
+        close(mids[i][1]);
+    }
+    free(mids);
+    return total;
+}
+
+/* splice_all - Splice exactly len bytes from in to out, or return -1 */
+int splice_all(int in, int out, size_t len) {
+    ssize_t got;
+
+    while (len > 0) {
+        got = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        len -= got;
+    }
+    return 0;
+}
+
+/* tee_copy - do_tee for anything tee_splice cannot handle */
+long long tee_copy(int *outs, int n, int *status) {
+    static char buf[READCHUNK];
+    long long total = 0;
+    ssize_t len, got;
+    int i;
+
+    while (1) {
+        len = read(STDIN_FILENO, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) {
+            if (len < 0) {
+                printf("tee: %s\n", strerror(errno));
+                *status = 1;
+            }
+            return total;
+        }
+        for (i = 0; i < n; i++) {
+            for (ssize_t off = 0; off < len; off += got) {
+                got = write(outs[i], buf + off, len - off);
+                if (got < 0 && errno == EINTR) {
+                    got = 0;
+                } else if (got < 0) {
+                    printf("tee: %s\n", strerror(errno));
+                    *status = 1;
+                    return total;
+                }
+            }
+        }
+        total += len;
+    }
+}
+
+/*
+ * do_cat - Execute the builtin cat command, which concatenates its files,
+ *    or stdin, to stdout with copy_fd. It only gets to run when cat_plain
+ *    says there are no options; with options, cat is exec'ed. In the
+ *    shell itself stdout is a file, so errors go to stderr.
+ */
+int do_cat(char **argv) {
+    struct stat in, out;
+    long long moved = 0, total = 0;
+    const char *how = "read";
+    int status = 0, fd, i;
+
+    fflush(stdout);
+    if (fstat(STDOUT_FILENO, &out) < 0) {
+        fprintf(stderr, "cat: write error: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 1; i == 1 || argv[i] != NULL; i++) {
+        if (argv[i] == NULL) {
+            fd = STDIN_FILENO;
+        } else if ((fd = open(argv[i], O_RDONLY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        //copying a file into itself would never reach the end
+        if (S_ISREG(out.st_mode) && fstat(fd, &in) == 0 && in.st_dev == out.st_dev &&
+            in.st_ino == out.st_ino && lseek(fd, 0, SEEK_CUR) < in.st_size) {
+            fprintf(stderr, "cat: %s: input file is output file\n", argv[i] ? argv[i] : "-");
+            status = 1;
+        } else if (copy_fd(fd, STDOUT_FILENO, &moved, &how) < 0) {
+            if (errno == EINTR) {
+                status = 130;
+            } else {
+                fprintf(stderr, "cat: %s: %s\n", argv[i] ? argv[i] : "-", strerror(errno));
+                status = 1;
+            }
+        }
+        total += moved;
+        if (fd != STDIN_FILENO)
+            close(fd);
+        if (status == 130 || argv[i] == NULL)
+            break;
+    }
+    if (verbose)
+        fprintf(stderr, "cat: %lld bytes by %s\n", total, how);
+    return status;
+}
+
+/* cat_plain - Whether do_cat can run cat argv, that is, it has no options */
+int cat_plain(char **argv) {
+    for (argv++; *argv != NULL; argv++) {
+        if ((*argv)[0] == '-')
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * is_copy - Whether the simple command node is a cat that copies into
+ *    a redirected stdout, from its files or from a redirected stdin.
+ *    exec_node runs these in the shell instead of forking cat. Opening
+ *    a FIFO waits for the other end, where ^C could not stop the shell,
+ *    so those are left to a real cat.
+ */
+int is_copy(struct node_t *node) {
+    struct stat st;
+
+    if (node->outfile == NULL || (node->argv[1] == NULL && node->infile == NULL) ||
+        !cat_plain(node->argv))
+        return 0;
+    if (stat(node->outfile, &st) == 0 && S_ISFIFO(st.st_mode))
+        return 0;
+    if (node->infile != NULL && stat(node->infile, &st) == 0 && S_ISFIFO(st.st_mode))
+        return 0;
+    for (char **arg = node->argv + 1; *arg != NULL; arg++) {
+        if (stat(*arg, &st) == 0 && S_ISFIFO(st.st_mode))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * copy_fd - Copy in to out until the end of in, without the data passing
+ *    through our memory where the kernel allows it: copy_file_range
+ *    between files, which can reflink or copy on the server; sendfile
+ *    from a file to anything else; splice when either end is a pipe;
+ *    read and write for the rest, and for files opened for appending,
+ *    which the others refuse. TSH_COPY can pick the first way to try,
+ *    see init_copy. *moved gets the bytes copied and *how
+ *    the last way used. In the shell, where SIGINT is blocked, a
+ *    pending ^C is taken off the queue and stops the copy between
+ *    chunks, and input that can block is waited on with poll so ^C is
+ *    noticed. Returns 0, or -1 with errno set, EINTR when stopped by ^C.
+ */
+int copy_fd(int in, int out, long long *moved, const char **how) {
+    static char buf[READCHUNK];
+    struct pollfd pfd = { in, POLLIN, 0 };
+    struct stat ist, ost;
+    sigset_t intr;
+    ssize_t len, got;
+    int way = 0;            /* 0 copy_file_range, 1 sendfile, 2 splice, 3 read */
+    int wait;
+
+    *moved = 0;
+    if (fstat(in, &ist) < 0 || fstat(out, &ost) < 0)
+        return -1;
+    if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))
+        way = S_ISREG(ist.st_mode) ? 1 : 2;
+    else if (!S_ISREG(ist.st_mode) || (fcntl(out, F_GETFL) & O_APPEND))
+        way = 3;
+    else if (!S_ISREG(ost.st_mode))
+        way = 1;
+    if (copy_way >= 0 && way < 3)
+        way = copy_way;
+    wait = !subshell && !S_ISREG(ist.st_mode) && !S_ISBLK(ist.st_mode);
+
+    sigemptyset(&intr);
+    sigaddset(&intr, SIGINT);
+    while (1) {
+        // Take the ^C off the queue as we act on it, or the signalfd would
+        // still hold it and poll_events would send it to the next job
+        if (!subshell && sigtimedwait(&intr, NULL, &(struct timespec){ 0, 0 }) == SIGINT) {
+            errno = EINTR;
+            return -1;
+        }
+        if (wait && poll(&pfd, 1, 100) == 0)
+            continue;
+
+        switch (way) {
+            case 0:
+                len = copy_file_range(in, NULL, out, NULL, COPYCHUNK, 0);
+                break;
+            case 1:
+                len = sendfile(out, in, NULL, COPYCHUNK);
+                break;
+            case 2:
+                len = splice(in, NULL, out, NULL, COPYCHUNK, SPLICE_F_MOVE);
+                break;
+            default:
+                len = read(in, buf, sizeof(buf));
+                for (ssize_t off = 0; len > 0 && off < len; off += got) {
+                    while ((got = write(out, buf + off, len - off)) < 0 && errno == EINTR)
+                        ;
+                    if (got < 0)
+                        return -1;
+                }
+                break;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && way < 3 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                                   errno == EOPNOTSUPP)) {
+            //this pair of descriptors does not support it, try the next way
+            way++;
+            if (way == 2 && !S_ISFIFO(ist.st_mode) && !S_ISFIFO(ost.st_mode))
+                way = 3;
+            continue;
+        }
+        if (len < 0)
+            return -1;
+        *how = (const char *[]){ "copy_file_range", "sendfile", "splice", "read" }[way];
+        if (len == 0)
+            return 0;
+        *moved += len;
+    }
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands
+ */
+int do_bgfg(char **argv) {
+    struct job_t *cur_job;
+    int pid, jid;
+    char *id = NULL;
+
+    //a forked copy of the shell has a copy of the job list, but the jobs
+    //are not its children and it has no event loop to wait on them with
+    if (subshell) {
+        printf("%s: no job control\n", argv[0]);
+        return 1;
+    }
+
+    //ensuring we actually have an id argument
+    if (argv[1] == NULL) {
+        printf("%s command requires PID or %%jid argument\n", argv[0]);
+        return 1;
+    } else {
+        id = argv[1];
+    }
+
+    if (id[0] == '%') {
+        jid = atoi(&id[1]);
+        if (jid == 0) {
+            printf("%s: argument must be a PID or %%jid\n", argv[0]);
+            return 1;
+        }
+        cur_job = getjobjid(&jobs, jid);
+        if (cur_job == NULL) {
+            printf("%%%d: No such job\n", jid);
+            return 1;
+        }
+    }
+    else {
+        pid = atoi(&id[0]);
+        if (pid == 0) {
+            printf("%s: argument must be a PID or %%jid\n", argv[0]);
+            return 1;
+        }
+        cur_job = getjobpid(&jobs, pid);
+        if (cur_job == NULL) {
+            printf("(%d): No such process\n", pid);
+            return 1;
+        }    
+    }
+
+    if (strcmp(argv[0], "bg") == 0 && cur_job->state == ST) {
+        if (!kill_job(cur_job->pid, SIGCONT))
+            return 0; // it was done, and has just been reported
+        setjobstate(&jobs, cur_job, BG);
+        printf("[%d] (%d) %s", cur_job->jid, cur_job->pid, cur_job->cmdline);
+        return 0;
+    } 
+    else if (strcmp(argv[0], "fg") == 0 && (cur_job->state == ST || cur_job->state == BG )) {
+        if (!kill_job(cur_job->pid, SIGCONT))
+            return 0;
+        setjobstate(&jobs, cur_job, FG);
+        waitfg(cur_job->pid);
+        return fg_status;
+    }
+    return 0;
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid) {
+    struct job_t *job = getjobpid(&jobs, pid);
+    struct timespec start;
+    long window, took;
+
+    // Run the event loop until the job is no longer in the foreground.
+    // Exits show up on the job's pidfds and stops through SIGCHLD on the
+    // signalfd; either way the job is updated before poll_events returns,
+    // so we only ever look at this one job instead of scanning the list.
+    //
+    // When recent jobs have been short, poll without sleeping for about
+    // twice their usual length first: a job that is done by then costs
+    // no wakeup. Long jobs push the average past spin.max and turn the
+    // spinning off until short ones bring it back down.
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    window = spin.avg < spin.max ? 2 * spin.avg : 0;
+    if (window > spin.max)
+        window = spin.max;
+    while (job != NULL && job->pid == pid && job->state == FG && elapsed_ns(&start) < window) {
+        poll_events(0);
+    }
+
+    while (job != NULL && job->pid == pid && job->state == FG) {
+        poll_events(-1);
+    }
+
+    //a single long job should not keep spinning off for too long
+    took = elapsed_ns(&start);
+    if (took > 4 * spin.max)
+        took = 4 * spin.max;
+    spin.avg += (took - spin.avg) / 8;
+}
+
+/*
+ * init_spin - Let waitfg spin for up to TSH_SPIN us (SPINMAX if unset,
+ *    0 never to spin). Spinning is pointless on a single CPU, where it
+ *    only takes time away from the child being waited for.
+ */
+void init_spin(void) {
+    const char *env = getenv("TSH_SPIN");
+
+    spin.max = (env ? atol(env) : SPINMAX) * 1000;
+    if (spin.max < 0 || sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        spin.max = 0;
+}
+
+/*
+ * init_ballast - Allocate and dirty TSH_BALLAST MB that are never used,
+ *    so launchers can be timed against a large shell (see rssbench).
+ *    The spawner was forked before this and stays small.
+ */
+void init_ballast(void) {
+    const char *env = getenv("TSH_BALLAST");
+    size_t size;
+
+    if (env == NULL || (size = strtoul(env, NULL, 10) << 20) == 0)
+        return;
+    if ((ballast = malloc(size)) == NULL)
+        unix_error("init_ballast error");
+    memset(ballast, 1, size);
+}
+
+/*
+ * init_copy - TSH_COPY names the way copy_fd tries first: copy_file_range,
+ *    sendfile, splice or read. Ways the descriptors do not support are
+ *    still skipped. Unset, copy_fd picks by file types. Used by catbench
+ *    to time each way on the same files.
+ */
+void init_copy(void) {
+    static const char *ways[] = { "copy_file_range", "sendfile", "splice", "read" };
+    const char *env = getenv("TSH_COPY");
+
+    if (env == NULL)
+        return;
+    for (copy_way = 3; copy_way >= 0 && strcmp(env, ways[copy_way]) != 0; copy_way--)
+        ;
+    if (copy_way < 0)
+        printf("TSH_COPY: unknown way '%s', ignored\n", env);
+}
+
+/*
+ * init_pipes - Pipes start at TSH_PIPE_SIZE bytes (a K or M suffix is
+ *    allowed), or at the kernel's default if unset or not a size, and are
+ *    allowed to grow up to /proc/sys/fs/pipe-max-size. TSH_PIPE_SIZE=0
+ *    leaves them alone.
+ */
+void init_pipes(void) {
+    const char *env = getenv("TSH_PIPE_SIZE");
+    char *end;
+    long size = 0;
+    FILE *f;
+    int fds[2], shift = 0;
+
+    if (env != NULL) {
+        errno = 0;
+        size = strtol(env, &end, 10);
+        if (end != env && (*end == 'k' || *end == 'K'))
+            shift = 10, end++;
+        else if (end != env && (*end == 'm' || *end == 'M'))
+            shift = 20, end++;
+        if (end == env || *end != '\0' || size < 0 || size > (INT_MAX >> shift) || errno != 0) {
+            printf("TSH_PIPE_SIZE: invalid size '%s', ignored\n", env);
+            size = 0;
+        }
+        else if (size == 0)
+            return;
+        size <<= shift;
+    }
+
+    //growing needs a size to start from, so find out the default
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return;
+    pipesize.cur = pipesize.base = fcntl(fds[1], F_GETPIPE_SZ);
+    close(fds[0]);
+    close(fds[1]);
+    if (pipesize.base <= 0 || (f = fopen("/proc/sys/fs/pipe-max-size", "r")) == NULL)
+        return;
+    if (fscanf(f, "%d", &pipesize.max) != 1)
+        pipesize.max = 0;
+    fclose(f);
+
+    if (size > 0 && pipesize.max > 0)
+        pipesize.cur = size < pipesize.max ? size : pipesize.max;
+    pipesize.start = pipesize.cur;
+}
+
+/*
+ * tune_pipes - Called when a pipeline job is done. A stage that slept
+ *    often while the stage reading from it used more CPU than it did was
+ *    most likely waiting for room in a full pipe: if any stage looks like
+ *    that, make the next pipes twice as big, up to pipe-max-size. If none
+ *    does, halve them back toward the size they started at, so that one
+ *    heavy pipeline does not size every later one.
+ */
+void tune_pipes(struct job_t *job) {
+    struct proc_t *w, *r;
+    int i, blocked = 0, size;
+
+    if (job->nprocs < 2 || pipesize.max == 0)
+        return;
+    for (i = 0; i < job->nprocs - 1; i++) {
+        w = &job->procs[i];
+        r = &job->procs[i + 1];
+        if (w->nvcsw >= PIPEBLOCKS && r->cpu > w->cpu)
+            blocked++;
+    }
+    if (blocked > 0)
+        size = pipesize.cur < pipesize.max / 2 ? pipesize.cur * 2 : pipesize.max;
+    else
+        size = pipesize.cur / 2 > pipesize.start ? pipesize.cur / 2 : pipesize.start;
+    if (size == pipesize.cur)
+        return;
+    pipesize.cur = size;
+    if (verbose)
+        printf("tune_pipes: pipes %s to %d bytes\n", blocked ? "grow" : "shrink", pipesize.cur);
+}
+
+/* elapsed_ns - Nanoseconds since the monotonic time in since */
+long elapsed_ns(struct timespec *since) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000L + (now.tv_nsec - since->tv_nsec);
+}
+
+
+/*
+ * init_events - Block SIGCHLD, SIGINT and SIGTSTP and set up the epoll
+ *    set the shell sleeps on: a signalfd for those signals and stdin.
+ *    Pidfds of running processes are added as jobs are created.
+ */
+void init_events(void) {
+    struct stat st;
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, &child_mask);
+
+    sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sigfd < 0 || epfd < 0)
+        unix_error("event setup error");
+    init_uring();
+
+    if (watch_fd(sigfd, EV_SIGNAL, 0) < 0)
+        unix_error("event setup error");
+
+    // One-shot, so that unread input does not keep waking us up while a
+    // foreground job runs. Regular files can't be polled; they are just
+    // read directly since they never block.
+    if (fstat(STDIN_FILENO, &st) == 0 && !S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+        inbuf.pollable = (watch_fd(STDIN_FILENO, EV_STDIN, 1) == 0);
+}
+
+/*
+ * init_uring - With TSH_EVENTS=uring, set up an io_uring to wait on
+ *    instead of the epoll set. Every watch becomes a poll request, and
+ *    the ones queued since the last wait go to the kernel in the same
+ *    io_uring_enter that waits, so re-arming stdin or watching a new
+ *    job's pidfds costs no syscalls of its own. Kernels without io_uring,
+ *    or too old for the features used, keep epoll. Multishot polls came
+ *    in 5.13 without a feature bit of their own; before that they fail
+ *    at once and re-arming them would spin, so RSRC_TAGS, also new in
+ *    5.13, stands in for them.
+ */
+void init_uring(void) {
+    const char *env = getenv("TSH_EVENTS");
+    struct io_uring_params p;
+    size_t sqlen, cqlen;
+    char *sq, *cq;
+    int fd;
+
+    if (env == NULL || strcmp(env, "uring") != 0)
+        return;
+    memset(&p, 0, sizeof(p));
+    fd = syscall(SYS_io_uring_setup, URINGSIZE, &p);
+    if (fd < 0)
+        return;
+    if ((p.features & (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS))
+        != (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_RSRC_TAGS)) {
+        close(fd);
+        return;
+    }
+
+    //both rings live in one mapping; forked children get none of it
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqlen > sqlen)
+        sqlen = cqlen;
+    sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (uring.sqes == MAP_FAILED) {
+        munmap(sq, sqlen);
+        close(fd);
+        return;
+    }
+    madvise(sq, sqlen, MADV_DONTFORK);
+    madvise(uring.sqes, p.sq_entries * sizeof(struct io_uring_sqe), MADV_DONTFORK);
+
+    cq = sq;
+    uring.sqhead = (unsigned *)(sq + p.sq_off.head);
+    uring.sqtail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sqarray = (unsigned *)(sq + p.sq_off.array);
+    uring.sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sqsize = p.sq_entries;
+    uring.cqhead = (unsigned *)(cq + p.cq_off.head);
+    uring.cqtail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    uring.fd = fd;
+}
+
+/*
+ * watch_fd - Have the event loop report key when fd becomes readable:
+ *    once (until rewatch_fd), or for as long as fd is open. Returns -1
+ *    if fd cannot be waited on.
+ */
+int watch_fd(int fd, uint64_t key, int once) {
+    struct epoll_event ev;
+
+    if (uring.fd != -1) {
+        if (!once && key < EV_PROC)
+            uring.fds[key] = fd;
+        uring_poll(fd, key, once);
+        return 0;
+    }
+    ev.events = EPOLLIN | (once ? EPOLLONESHOT : 0);
+    ev.data.u64 = key;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* rewatch_fd - Ask again for a one-shot watch_fd that has fired */
+void rewatch_fd(int fd, uint64_t key) {
+    struct epoll_event ev;
+
+    if (uring.fd != -1) {
+        uring_poll(fd, key, 1);
+        return;
+    }
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = key;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * wait_events - Wait up to timeout ms (-1 forever, 0 not at all) for
+ *    watched fds, and store the keys of up to max of them that are ready.
+ *    Returns how many were stored.
+ */
+int wait_events(uint64_t *keys, int max, int timeout) {
+    struct epoll_event evs[MAXEVENTS];
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int i, n;
+    long ret;
+
+    if (uring.fd == -1) {
+        n = epoll_wait(epfd, evs, max < MAXEVENTS ? max : MAXEVENTS, timeout);
+        for (i = 0; i < n; i++)
+            keys[i] = evs[i].data.u64;
+        return n < 0 ? 0 : n;
+    }
+
+    //submit and wait in one go; skip the syscall if there is nothing to
+    //submit and no reason to wait
+    head = *uring.cqhead;
+    tail = __atomic_load_n(uring.cqtail, __ATOMIC_ACQUIRE);
+    if (uring.queued > 0 || (head == tail && timeout != 0)) {
+        memset(&arg, 0, sizeof(arg));
+        if (timeout > 0) {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        ret = syscall(SYS_io_uring_enter, uring.fd, uring.queued, head == tail && timeout != 0,
+                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (ret > 0)
+            uring.queued -= ret;
+        tail = __atomic_load_n(uring.cqtail, __ATOMIC_ACQUIRE);
+    }
+
+    for (n = 0; head != tail && n < max; head++) {
+        cqe = &uring.cqes[head & uring.cqmask];
+        keys[n++] = cqe->user_data;
+        //a multishot poll the kernel gave up on has to be asked for again
+        if (cqe->user_data < EV_PROC && uring.fds[cqe->user_data] > 0 && !(cqe->flags & IORING_CQE_F_MORE))
+            uring_poll(uring.fds[cqe->user_data], cqe->user_data, 0);
+    }
+    __atomic_store_n(uring.cqhead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * uring_sqe - The next free submission queue entry, cleared. If the
+ *    queue is full, what is in it is submitted first.
+ */
+struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *uring.sqtail;
+    long ret;
+
+    if (tail - __atomic_load_n(uring.sqhead, __ATOMIC_ACQUIRE) == uring.sqsize) {
+        ret = syscall(SYS_io_uring_enter, uring.fd, uring.queued, 0, 0, NULL, 0);
+        if (ret > 0)
+            uring.queued -= ret;
+    }
+    sqe = &uring.sqes[tail & uring.sqmask];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sqarray[tail & uring.sqmask] = tail & uring.sqmask;
+    return sqe;
+}
+
+/* uring_poll - Queue a poll for fd becoming readable, reported as key */
+void uring_poll(int fd, uint64_t key, int once) {
+    struct io_uring_sqe *sqe = uring_sqe();
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = once ? 0 : IORING_POLL_ADD_MULTI;
+    sqe->user_data = key;
+    __atomic_store_n(uring.sqtail, *uring.sqtail + 1, __ATOMIC_RELEASE);
+    uring.queued++;
+}
+
+/*
+ * poll_events - Wait up to timeout ms (-1 forever, 0 not at all) for
+ *    events and handle them. This is the only place where children are
+ *    reaped and job states change, so none of it can race with eval.
+ */
+void poll_events(int timeout) {
+    uint64_t keys[MAXEVENTS];
+    struct signalfd_siginfo si;
+    struct job_t *job;
+    struct proc_t *proc;
+    uint64_t src;
+    eventfd_t pushed;
+    int i, n, p;
+
+    n = wait_events(keys, MAXEVENTS, timeout);
+    for (i = 0; i < n; i++) {
+        src = keys[i];
+        if (src == EV_SIGNAL) {
+            while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+                if (si.ssi_signo == SIGCHLD)
+                    sigchld_handler(SIGCHLD);
+                else if (si.ssi_signo == SIGINT)
+                    sigint_handler(SIGINT);
+                else if (si.ssi_signo == SIGTSTP)
+                    sigtstp_handler(SIGTSTP);
+            }
+        }
+        else if (src == EV_STDIN) {
+            inbuf.ready = 1;
+        }
+        else if (src == EV_REAPED) {
+            eventfd_read(reaper.wake, &pushed); // applied below
+        }
+        else {
+            // A process exited; the pidfd tells us which one without a
+            // lookup. It may already have been reaped via SIGCHLD, and
+            // even applied and its whole job deleted if the ring filled.
+            job = &jobs.slots[(src - EV_PROC) >> 32];
+            p = (src - EV_PROC) & 0xffffffff;
+            if (job->pid == 0 || p >= job->nprocs)
+                continue;
+            proc = &job->procs[p];
+            if (proc->pidfd != -1)
+                reap_pid(proc->pid);
+        }
+    }
+    apply_reaped();
+    fflush(stdout);
+}
+
+/*
+ * read_cmdline - Read the next line from stdin, running the event loop
+ *    while waiting for it. Input is read in large chunks into inbuf,
+ *    which grows to hold the longest line seen and is reused after that.
+ *    Lines longer than ARG_MAX could never be run and are skipped.
+ *    Returns the line, valid until the next call, or NULL at end of file.
+ */
+char *read_cmdline(void) {
+    char *nl;
+    size_t n;
+    ssize_t got;
+    int timeout;
+
+    if (inbuf.maxline == 0) {
+        inbuf.maxline = sysconf(_SC_ARG_MAX);
+    }
+
+    while (1) {
+        //only look at bytes that have not been searched before, so a long
+        //line arriving in many reads is scanned once
+        nl = memchr(inbuf.buf + inbuf.start + inbuf.scanned, '\n', inbuf.len - inbuf.start - inbuf.scanned);
+        if (nl == NULL) {
+            inbuf.scanned = inbuf.len - inbuf.start;
+        }
+        if (nl == NULL && inbuf.eof && inbuf.len > inbuf.start && !inbuf.skipping) {
+            nl = inbuf.buf + inbuf.len - 1; // last line, without a newline
+        }
+        if (nl != NULL) {
+            n = nl - (inbuf.buf + inbuf.start) + 1;
+            if (inbuf.skipping) {
+                inbuf.skipping = 0;
+                inbuf.start += n;
+                inbuf.scanned = 0;
+                continue;
+            }
+            if (n + 1 > inbuf.linecap) {
+                free(inbuf.line);
+                inbuf.linecap = n + 1 > 2 * inbuf.linecap ? n + 1 : 2 * inbuf.linecap;
+                inbuf.line = malloc(inbuf.linecap);
+                if (inbuf.line == NULL)
+                    unix_error("read_cmdline error");
+            }
+            memcpy(inbuf.line, inbuf.buf + inbuf.start, n);
+            inbuf.line[n] = '\0';
+            inbuf.start += n;
+            inbuf.scanned = 0;
+            return inbuf.line;
+        }
+        if (inbuf.scanned > inbuf.maxline) {
+            printf("Line too long\n");
+            inbuf.skipping = 1;
+            inbuf.start = inbuf.len;
+            inbuf.scanned = 0;
+        }
+        if (inbuf.eof) {
+            return NULL;
+        }
+        //top the pool up a helper at a time while nothing has come in;
+        //input that is never waited for, a file, leaves it to spawn_fork
+        timeout = pool_tick();
+        if (inbuf.pollable && !inbuf.ready) {
+            poll_events(timeout);
+            if (!inbuf.ready)
+                pool_refill();
+            continue;
+        }
+
+        //make room for a full read: first by dropping the lines already
+        //returned, then by doubling the buffer
+        if (inbuf.cap - inbuf.len < READCHUNK && inbuf.start > 0) {
+            memmove(inbuf.buf, inbuf.buf + inbuf.start, inbuf.len - inbuf.start);
+            inbuf.len -= inbuf.start;
+            inbuf.start = 0;
+        }
+        if (inbuf.cap - inbuf.len < READCHUNK) {
+            inbuf.cap = inbuf.cap ? 2 * inbuf.cap : 2 * READCHUNK;
+            inbuf.buf = realloc(inbuf.buf, inbuf.cap);
+            if (inbuf.buf == NULL)
+                unix_error("read_cmdline error");
+        }
+
+        got = read(STDIN_FILENO, inbuf.buf + inbuf.len, inbuf.cap - inbuf.len);
+        if (got < 0 && errno != EINTR && errno != EAGAIN)
+            unix_error("read error");
+        if (got == 0)
+            inbuf.eof = 1;
+        if (got > 0)
+            inbuf.len += got;
+        if (inbuf.pollable) {
+            inbuf.ready = 0;
+            rewatch_fd(STDIN_FILENO, EV_STDIN);
+        }
+    }
+}
+
+/*****************
+ * Signal handlers
+ *****************/
 
 /* 
  * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
  *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+ *     received a SIGSTOP or SIGTSTP signal. SIGCHLD is blocked and read
+ *     from the signalfd, so this runs synchronously from poll_events.
+ *     It reaps all available zombie children into the reaped ring,
+ *     applying what is there only when the ring fills up; poll_events
+ *     applies the rest once its batch of events is handled. With -r the
+ *     reaper thread has them all, and there is nothing to do here.
  */
-#include <unistd.h> // For write()
-
 void sigchld_handler(int sig) {
-    pid_t pid;
-    int status;
+    if (reaper.on)
+        return;
+    while (reap_children())
+        apply_reaped();
+}
+
+/*
+ * reap_slot - The reaper's next free slot in the ring, or NULL if the
+ *    ring is full. Nothing is visible to apply_reaped until reap_commit.
+ */
+struct reap_t *reap_slot(void) {
+    unsigned head = atomic_load_explicit(&reaped.head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&reaped.tail, memory_order_acquire) == REAPRING)
+        return NULL;
+    return &reaped.recs[head % REAPRING];
+}
+
+/* reap_commit - Publish the slot filled in after reap_slot */
+void reap_commit(void) {
+    atomic_fetch_add_explicit(&reaped.head, 1, memory_order_release);
+}
+
+/*
+ * reap_children - Reap every child with a state change waiting, without
+ *    blocking. A slot is claimed before each wait, so a full ring leaves
+ *    the rest waiting in the kernel rather than losing them. Returns 1 if
+ *    it stopped because the ring was full, 0 once there is nothing left.
+ *    The raw waitid syscall is used because it reports both the siginfo
+ *    and the rusage, which neither glibc wrapper does.
+ */
+int reap_children(void) {
+    struct reap_t *rec;
+    siginfo_t si;
+
+    while ((rec = reap_slot()) != NULL) {
+        si.si_pid = 0;
+        if (syscall(SYS_waitid, P_ALL, 0, &si, WNOHANG | WEXITED | WSTOPPED, &rec->ru) < 0 || si.si_pid == 0)
+            return 0;
+        rec->pid = si.si_pid;
+        rec->status = wait_status(&si);
+        reap_commit();
+    }
+    return 1;
+}
+
+/*
+ * reap_pid - Reap one child whose pidfd says it exited, unless it was
+ *    reaped already.
+ */
+void reap_pid(pid_t pid) {
+    struct reap_t *rec;
+    siginfo_t si;
+
+    if ((rec = reap_slot()) == NULL) {
+        apply_reaped();
+        rec = reap_slot();
+    }
+    si.si_pid = 0;
+    if (syscall(SYS_waitid, P_PID, pid, &si, WNOHANG | WEXITED, &rec->ru) == 0 && si.si_pid == pid) {
+        rec->pid = pid;
+        rec->status = wait_status(&si);
+        reap_commit();
+    }
+}
+
+/*
+ * wait_status - Turn what waitid reports into the status waitpid would
+ *    have, which is what the WIF* macros in update_job take apart.
+ */
+int wait_status(siginfo_t *si) {
+    switch (si->si_code) {
+    case CLD_EXITED:
+        return (si->si_status & 0xff) << 8;
+    case CLD_KILLED:
+        return si->si_status & 0x7f;
+    case CLD_DUMPED:
+        return (si->si_status & 0x7f) | 0x80;
+    default:                /* CLD_STOPPED, CLD_TRAPPED */
+        return ((si->si_status & 0xff) << 8) | 0x7f;
+    }
+}
+
+/*
+ * apply_reaped - Apply everything in the ring to the job list, in the
+ *    order it was reaped. Children that are not in a job, like the pool
+ *    helpers, are just dropped.
+ */
+void apply_reaped(void) {
+    unsigned tail = atomic_load_explicit(&reaped.tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&reaped.head, memory_order_acquire);
+    struct reap_t *rec;
     struct job_t *job;
-    char buf[256]; // Buffer for messages
-    int err;
+    struct proc_t *proc;
 
-    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED)) > 0) {
-        job = getjobpid(jobs, pid);
+    for (; tail != head; tail++) {
+        rec = &reaped.recs[tail % REAPRING];
+        job = getjobpid(&jobs, rec->pid);
+        if (job != NULL) {
+            proc = getprocpid(job, rec->pid);
+            proc->nvcsw = rec->ru.ru_nvcsw;
+            proc->cpu = (rec->ru.ru_utime.tv_sec + rec->ru.ru_stime.tv_sec) * 1000000L +
+                        rec->ru.ru_utime.tv_usec + rec->ru.ru_stime.tv_usec;
+            update_job(job, proc, rec->status);
+        }
+    }
+    atomic_store_explicit(&reaped.tail, tail, memory_order_release);
+    if (atomic_exchange(&reaper.full, 0))
+        eventfd_write(reaper.room, 1);
+    flush_notices();
+}
 
-        if (WIFSTOPPED(status)) {
-            // Update job state to stopped
-            if (job != NULL) {
-                job->state = ST;
-            }
-            int len = snprintf(buf, sizeof(buf), "Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
-            if (len > 0) {
-                err = write(STDOUT_FILENO, buf, len);
-                if (err == -1) {
-                    exit(1);
-                }
-            }
-        } else if (WIFSIGNALED(status)) {
+/*
+ * init_reaper - Start the reaper thread for -r. From then on it is the
+ *    ring's only producer: SIGCHLD is ignored and no pidfds are opened,
+ *    and poll_events applies what it pushed when reaper.wake fires. The
+ *    job list itself is still only touched by this thread, so jobs, fg
+ *    and bg need no locking.
+ */
+void init_reaper(void) {
+    if (!reaper.on)
+        return;
+    reaper.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reaper.kick = eventfd(0, EFD_CLOEXEC);
+    reaper.room = eventfd(0, EFD_CLOEXEC);
+    if (reaper.wake < 0 || reaper.kick < 0 || reaper.room < 0)
+        unix_error("init_reaper error");
+    if (watch_fd(reaper.wake, EV_REAPED, 0) < 0)
+        unix_error("init_reaper error");
+    pthread_mutex_init(&reaper.lock, NULL);
+    //signals stay blocked in the thread, it inherits our mask
+    errno = pthread_create(&reaper.thread, NULL, reaper_main, NULL);
+    if (errno != 0)
+        unix_error("init_reaper error");
+}
+
+/*
+ * reaper_main - Body of the reaper thread: block in waitid until a child
+ *    changes state and push it into the ring. The blocking wait leaves
+ *    the child waitable (WNOWAIT); it is only reaped under reaper.lock,
+ *    so that kill_job can hold off reaping while it signals a job. With
+ *    no children to wait for it sleeps until reaper_kick, and with the
+ *    ring full until apply_reaped has made room.
+ */
+void *reaper_main(void *arg) {
+    struct reap_t *rec;
+    eventfd_t n;
+    siginfo_t si;
+    pid_t pid;
+
+    while (1) {
+        if ((rec = reap_slot()) == NULL) {
+            atomic_store(&reaper.full, 1);
+            //apply_reaped may have drained it before seeing the flag
+            if (reap_slot() == NULL)
+                eventfd_read(reaper.room, &n);
+            continue;
+        }
+        si.si_pid = 0;
+        if (waitid(P_ALL, 0, &si, WEXITED | WSTOPPED | WNOWAIT) < 0) {
+            if (errno == ECHILD)
+                eventfd_read(reaper.kick, &n);
+            continue;
+        }
+        pid = si.si_pid;
+
+        //a stop may have been cancelled by SIGCONT in the meantime
+        pthread_mutex_lock(&reaper.lock);
+        si.si_pid = 0;
+        if (syscall(SYS_waitid, P_PID, pid, &si, WNOHANG | WEXITED | WSTOPPED, &rec->ru) == 0 && si.si_pid == pid) {
+            rec->pid = pid;
+            rec->status = wait_status(&si);
+            reap_commit();
+            eventfd_write(reaper.wake, 1);
+        }
+        pthread_mutex_unlock(&reaper.lock);
+    }
+    return NULL;
+}
+
+/* reaper_kick - Tell the reaper thread there is a new child to wait for */
+void reaper_kick(void) {
+    if (reaper.on)
+        eventfd_write(reaper.kick, 1);
+}
+
+/*
+ * notice - Queue a job notification. A storm of exits then costs one
+ *    write for the whole batch rather than one per job.
+ */
+void notice(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (1) {
+        va_start(ap, fmt);
+        n = vsnprintf(notices.buf + notices.len, notices.cap - notices.len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (notices.len + n < notices.cap)
+            break;
+        notices.cap = notices.cap ? 2 * notices.cap : 4096;
+        if (notices.cap <= notices.len + n)
+            notices.cap = notices.len + n + 1;
+        notices.buf = realloc(notices.buf, notices.cap);
+        if (notices.buf == NULL)
+            unix_error("notice error");
+    }
+    notices.len += n;
+}
+
+/*
+ * flush_notices - Write out the queued notifications, after whatever
+ *    stdout already holds so the output stays in order.
+ */
+void flush_notices(void) {
+    size_t off;
+    ssize_t n;
+
+    if (notices.len == 0)
+        return;
+    fflush(stdout);
+    for (off = 0; off < notices.len; off += n) {
+        n = write(STDOUT_FILENO, notices.buf + off, notices.len - off);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            break;
+    }
+    notices.len = 0;
+}
+
+/*
+ * update_job - Apply a wait status reported for one of job's processes
+ */
+void update_job(struct job_t *job, struct proc_t *proc, int status) {
+    if (WIFSTOPPED(status)) {
+        // Update job state to stopped, once for the whole pipeline
+        if (job->state != ST) {
+            if (job->state == FG)
+                fg_status = exit_status(status);
+            setjobstate(&jobs, job, ST);
+            notice("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, WSTOPSIG(status));
+        }
+    } else if (WIFSIGNALED(status) || WIFEXITED(status)) {
+        proc->status = status;
+        proc->done = 1;
+        if (proc->pidfd != -1) {
+            close(proc->pidfd); // also takes it out of the epoll set
+            proc->pidfd = -1;
+        }
+        // The kernel may hand a reaped PID to a new child while the rest of
+        // the pipeline runs, so drop it now. The leader's PID names the
+        // process group and is not reused until the group is empty
+        if (proc->pid != job->pid)
+            pidindex_del(&jobs.pidx, proc->pid);
+        if (--job->nlive > 0) {
+            return; // other stages are still running
+        }
+        // A pipeline reports the status of its last stage
+        status = job->procs[job->nprocs - 1].status;
+        if (job->state == FG)
+            fg_status = exit_status(status);
+        if (WIFSIGNALED(status)) {
             // Job was terminated by a signal
-            int len = snprintf(buf, sizeof(buf), "Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
-            if (len > 0) {
-                err = write(STDOUT_FILENO, buf, len);
-                if (err == -1) {
-                    exit(1);
-                }
-            }
-            deletejob(jobs, pid);
-        } else if (WIFEXITED(status)) {
-            // Job exited normally
-            deletejob(jobs, pid);
+            notice("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
         }
+        tune_pipes(job);
+        deletejob(&jobs, job->pid);
     }
 }
 
 
 /* 
  * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job.  
+ *    user types ctrl-c at the keyboard.  Read it from the signalfd and
+ *    send it along to the foreground job.  
  */
 void sigint_handler(int sig) {
 
-    pid_t pid = fgpid(jobs);
+    pid_t pid = fgpid(&jobs);
 
     if (pid != 0) {
-        kill(-pid, SIGINT); // Send SIGINT to the entire foreground process group
+        kill_job(pid, SIGINT); // Send SIGINT to the entire foreground process group
     }
 }
 
 /*
  * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP.  
+ *     the user types ctrl-z at the keyboard. Read it from the signalfd
+ *     and suspend the foreground job by sending it a SIGTSTP.  
  */
 void sigtstp_handler(int sig) {
 
-    pid_t pid = fgpid(jobs);
-    struct job_t *job = getjobpid(jobs, pid);
+    pid_t pid = fgpid(&jobs);
 
     if (pid != 0) {
-        kill(-pid, SIGTSTP); // Send SIGTSTP to the entire foreground process group
+        kill_job(pid, SIGTSTP); // Send SIGTSTP to the entire foreground process group
     }
 
-    //setting job state to stopped
-    if (job == NULL) {
-        exit(1);
-    } else {
-        job->state = ST;
+    //the job is marked stopped by sigchld_handler once the kernel reports it
+}
+
+/*
+ * kill_job - Send sig to the process group of the job led by pid. The
+ *    group's ID may be reused once its last member is reaped, so the job
+ *    has to be seen gone before that. Without -r we are the only reaper.
+ *    With -r, what the thread has reaped is applied first, and the thread
+ *    is kept from reaping more until the signal is sent. Returns 0 if the
+ *    job turned out to be done already.
+ */
+int kill_job(pid_t pid, int sig) {
+    int alive;
+
+    if (!reaper.on) {
+        kill(-pid, sig);
+        return 1;
     }
+    pthread_mutex_lock(&reaper.lock);
+    apply_reaped();
+    alive = getjobpid(&jobs, pid) != NULL;
+    if (alive)
+        kill(-pid, sig);
+    pthread_mutex_unlock(&reaper.lock);
+    return alive;
 }
 
 /*
@@ -627,128 +4389,227 @@ void clearjob(struct job_t *job) {
     job->pid = 0;
     job->jid = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    job->nprocs = 0;
+    job->nlive = 0;
+    job->procs = NULL;
+    job->cmdline = NULL;
 }
 
 /* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
+void initjobs(struct joblist_t *jobs) {
     int i;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    jobs->nslots = INITJOBS;
+    jobs->slots = malloc(sizeof(struct job_t) * jobs->nslots);
+    jobs->fg = -1;
+    jobs->pidx.cap = INITJOBS * 2;
+    jobs->pidx.count = 0;
+    jobs->pidx.pids = calloc(jobs->pidx.cap, sizeof(pid_t));
+    jobs->pidx.slots = malloc(sizeof(int) * jobs->pidx.cap);
+    jobs->jids.nwords = (INITJOBS + 63) / 64;
+    jobs->jids.words = calloc(jobs->jids.nwords, sizeof(uint64_t));
+    jobs->jids.hint = 0;
+    cmdlines.cap = INITJOBS * 2;
+    cmdlines.count = 0;
+    cmdlines.strs = calloc(cmdlines.cap, sizeof(struct istr_t *));
+    if (jobs->slots == NULL || jobs->pidx.pids == NULL || jobs->pidx.slots == NULL
+        || jobs->jids.words == NULL || cmdlines.strs == NULL)
+        unix_error("initjobs error");
+
+    for (i = 0; i < jobs->nslots; i++)
+        clearjob(&jobs->slots[i]);
 }
 
-/* freejid - Returns smallest free job ID */
-int freejid(struct job_t *jobs) {
-    int i;
-    int taken[MAXJOBS + 1] = {0};
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid != 0) 
-        taken[jobs[i].jid] = 1;
-    for (i = 1; i <= MAXJOBS; i++)
-        if (!taken[i])
-            return i;
-    return 0;
+/*
+ * freejid - Returns smallest free job ID. Finds the first word of the
+ *    jid bitmap with a zero bit, starting at the hint, and takes its
+ *    lowest zero bit. May return nslots + 1 when every slot is taken.
+ */
+int freejid(struct joblist_t *jobs) {
+    struct jidmap_t *map = &jobs->jids;
+    int w;
+
+    for (w = map->hint; w < map->nwords; w++) {
+        if (map->words[w] != ~(uint64_t)0) {
+            map->hint = w;
+            return w * 64 + __builtin_ctzll(~map->words[w]) + 1;
+        }
+    }
+    map->hint = map->nwords;
+    return map->nwords * 64 + 1;
+}
+
+/* jidmap_set - Mark jid as taken or free */
+void jidmap_set(struct jidmap_t *map, int jid, int taken) {
+    int w = (jid - 1) / 64;
+    uint64_t bit = (uint64_t)1 << ((jid - 1) % 64);
+
+    if (taken) {
+        map->words[w] |= bit;
+    } else {
+        map->words[w] &= ~bit;
+        if (w < map->hint)
+            map->hint = w;
+    }
 }
 
 /* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
+int addjob(struct joblist_t *jobs, struct proc_t *procs, int nprocs, int state, char *cmdline) {
+    struct job_t *job;
+    int i, j, slot;
     
-    if (pid < 1)
+    if (nprocs < 1 || procs[0].pid < 1)
         return 0;
     int free = freejid(jobs);
-    if (!free) {
+    slot = free - 1;
+
+    // Out of slots: double the list. Everything refers to jobs by slot
+    // number (the pid index, epoll data), so moving them is fine.
+    if (slot >= jobs->nslots) {
+        job = realloc(jobs->slots, sizeof(struct job_t) * jobs->nslots * 2);
+        if (job == NULL) {
+            printf("Tried to create too many jobs\n");
+            return 0;
+        }
+        jobs->slots = job;
+        for (i = jobs->nslots; i < jobs->nslots * 2; i++)
+            clearjob(&jobs->slots[i]);
+        jobs->nslots *= 2;
+    }
+    if (slot >= jobs->jids.nwords * 64) {
+        uint64_t *words = realloc(jobs->jids.words, sizeof(uint64_t) * jobs->jids.nwords * 2);
+        if (words == NULL) {
+            printf("Tried to create too many jobs\n");
+            return 0;
+        }
+        memset(words + jobs->jids.nwords, 0, sizeof(uint64_t) * jobs->jids.nwords);
+        jobs->jids.words = words;
+        jobs->jids.nwords *= 2;
+    }
+    jidmap_set(&jobs->jids, free, 1);
+
+    job = &jobs->slots[slot];
+    job->procs = malloc(sizeof(struct proc_t) * nprocs);
+    if (job->procs == NULL) {
+        jidmap_set(&jobs->jids, free, 0);
         printf("Tried to create too many jobs\n");
         return 0;
     }
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
+    job->pid = procs[0].pid;
+    job->jid = free;
+    job->nprocs = nprocs;
+    job->nlive = nprocs;
+    for (j = 0; j < nprocs; j++) {
+        job->procs[j].pid = procs[j].pid;
+        job->procs[j].pidfd = procs[j].pidfd;
+        job->procs[j].status = 0;
+        job->procs[j].done = 0;
+        job->procs[j].nvcsw = 0;
+        job->procs[j].cpu = 0;
+        pidindex_put(&jobs->pidx, procs[j].pid, slot);
+        if (procs[j].pidfd != -1) {
+            // Let the event loop tell us directly which process exited
+            watch_fd(procs[j].pidfd, EV_PROC + ((uint64_t)slot << 32) + j, 1);
         }
     }
-    return 0; /*suppress compiler warning*/
+    setjobstate(jobs, job, state);
+    job->cmdline = intern(&cmdlines, cmdline);
+    if(verbose){
+        printf("Added job [%d] %d %s\n", job->jid, job->pid, job->cmdline);
+    }
+    return 1;
 }
 
 /* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
+int deletejob(struct joblist_t *jobs, pid_t pid) {
+    struct job_t *job;
+    int j;
 
     if (pid < 1)
         return 0;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            return 1;
-        }
-    }
-    return 0;
+    job = getjobpid(jobs, pid);
+    if (job == NULL || job->pid != pid)
+        return 0;
+    setjobstate(jobs, job, UNDEF);
+    // Reaped members other than the leader are already out of the index
+    for (j = 0; j < job->nprocs; j++)
+        if (job->procs[j].pid == pid || !job->procs[j].done)
+            pidindex_del(&jobs->pidx, job->procs[j].pid);
+    jidmap_set(&jobs->jids, job->jid, 0);
+    unintern(&cmdlines, job->cmdline);
+    free(job->procs);
+    clearjob(job);
+    return 1;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/* setjobstate - Change a job's state, keeping track of the foreground job */
+void setjobstate(struct joblist_t *jobs, struct job_t *job, int state) {
+    int slot = job - jobs->slots;
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+    if (state == FG)
+        jobs->fg = slot;
+    else if (jobs->fg == slot)
+        jobs->fg = -1;
+    job->state = state;
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct joblist_t *jobs) {
+    if (jobs->fg < 0)
+        return 0;
+    return jobs->slots[jobs->fg].pid;
+}
+
+/* getjobpid  - Find a job (by the PID of any of its processes) on the job list */
+struct job_t *getjobpid(struct joblist_t *jobs, pid_t pid) {
+    int slot;
 
     if (pid < 1)
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
+    slot = pidindex_get(&jobs->pidx, pid);
+    if (slot < 0)
+        return NULL;
+    return &jobs->slots[slot];
+}
+
+/* getprocpid - Find a process (by PID) within a job */
+struct proc_t *getprocpid(struct job_t *job, pid_t pid) {
+    int i;
+
+    for (i = 0; i < job->nprocs; i++)
+        if (job->procs[i].pid == pid)
+            return &job->procs[i];
     return NULL;
 }
 
 /* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
+struct job_t *getjobjid(struct joblist_t *jobs, int jid) 
 {
-    int i;
-
-    if (jid < 1)
+    if (jid < 1 || jid > jobs->nslots || jobs->slots[jid - 1].pid == 0)
         return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+    return &jobs->slots[jid - 1];
 }
 
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) {
-    int i;
+    struct job_t *job = getjobpid(&jobs, pid);
 
-    if (pid < 1)
+    if (job == NULL)
         return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
-    }
-    return 0;
+    return job->jid;
 }
 
 /* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
+void listjobs(struct joblist_t *jobs) {
+    struct job_t *job;
     int i;
     
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
+    for (i = 0; i < jobs->nslots; i++) {
+        job = &jobs->slots[i];
+        if (job->pid != 0) {
+            printf("[%d] (%d) ", job->jid, job->pid);
+            switch (job->state) {
                 case BG: 
                     printf("Running ");
                     break;
@@ -760,11 +4621,188 @@ void listjobs(struct job_t *jobs) {
                     break;
                 default:
                     printf("listjobs: Internal error: job[%d].state=%d ", 
-                       i, jobs[i].state);
+                       i, job->state);
             }
-            printf("%s", jobs[i].cmdline);
+            printf("%s", job->cmdline);
+        }
+    }
+}
+
+/*
+ * pidindex_bucket - Home bucket of a PID. Multiplicative hashing, folding
+ *    the high bits down since PIDs are mostly sequential.
+ */
+unsigned pidindex_bucket(struct pidindex_t *ix, pid_t pid) {
+    uint32_t h = (uint32_t)pid * 2654435761u;
+    return (h ^ (h >> 16)) & (ix->cap - 1);
+}
+
+/* pidindex_get - Return the slot for pid, -1 if it isn't indexed */
+int pidindex_get(struct pidindex_t *ix, pid_t pid) {
+    unsigned b = pidindex_bucket(ix, pid);
+
+    // Linear probing; the index is at most half full so runs are short
+    while (ix->pids[b] != 0) {
+        if (ix->pids[b] == pid)
+            return ix->slots[b];
+        b = (b + 1) & (ix->cap - 1);
+    }
+    return -1;
+}
+
+/* pidindex_put - Map pid to slot, growing the index when half full */
+void pidindex_put(struct pidindex_t *ix, pid_t pid, int slot) {
+    unsigned b;
+    int i;
+
+    if ((ix->count + 1) * 2 > ix->cap) {
+        struct pidindex_t old = *ix;
+
+        ix->cap *= 2;
+        ix->count = 0;
+        ix->pids = calloc(ix->cap, sizeof(pid_t));
+        ix->slots = malloc(sizeof(int) * ix->cap);
+        if (ix->pids == NULL || ix->slots == NULL)
+            unix_error("pidindex_put error");
+        for (i = 0; i < old.cap; i++)
+            if (old.pids[i] != 0)
+                pidindex_put(ix, old.pids[i], old.slots[i]);
+        free(old.pids);
+        free(old.slots);
+    }
+
+    b = pidindex_bucket(ix, pid);
+    while (ix->pids[b] != 0 && ix->pids[b] != pid)
+        b = (b + 1) & (ix->cap - 1);
+    if (ix->pids[b] == 0)
+        ix->count++;
+    ix->pids[b] = pid;
+    ix->slots[b] = slot;
+}
+
+/* pidindex_del - Remove pid from the index */
+void pidindex_del(struct pidindex_t *ix, pid_t pid) {
+    unsigned b = pidindex_bucket(ix, pid);
+    unsigned next, home;
+
+    while (ix->pids[b] != pid) {
+        if (ix->pids[b] == 0)
+            return;
+        b = (b + 1) & (ix->cap - 1);
+    }
+
+    // Move later entries of the probe run back into the hole, so that
+    // lookups never need tombstones
+    next = b;
+    while (1) {
+        next = (next + 1) & (ix->cap - 1);
+        if (ix->pids[next] == 0)
+            break;
+        home = pidindex_bucket(ix, ix->pids[next]);
+        if (((next - home) & (ix->cap - 1)) >= ((next - b) & (ix->cap - 1))) {
+            ix->pids[b] = ix->pids[next];
+            ix->slots[b] = ix->slots[next];
+            b = next;
+        }
+    }
+    ix->pids[b] = 0;
+    ix->count--;
+}
+/* strhash - FNV-1a hash of the len bytes at s */
+unsigned strhash(const char *s, int len) {
+    unsigned h = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * intern - Return the copy of s kept in tab, adding one if needed. Jobs
+ *    started from the same command line share a single copy, and each
+ *    copy takes exactly as much memory as its text.
+ */
+const char *intern(struct strtab_t *tab, const char *s) {
+    struct istr_t *str;
+    int len = strlen(s);
+    unsigned h = strhash(s, len);
+    unsigned b;
+    int i;
+
+    b = h & (tab->cap - 1);
+    while ((str = tab->strs[b]) != NULL) {
+        if (str->hash == h && str->len == len && memcmp(str->text, s, len) == 0) {
+            str->refs++;
+            return str->text;
+        }
+        b = (b + 1) & (tab->cap - 1);
+    }
+
+    if ((tab->count + 1) * 2 > tab->cap) {
+        struct istr_t **old = tab->strs;
+        int oldcap = tab->cap;
+
+        tab->strs = calloc(oldcap * 2, sizeof(struct istr_t *));
+        if (tab->strs == NULL)
+            unix_error("intern error");
+        tab->cap = oldcap * 2;
+        for (i = 0; i < oldcap; i++) {
+            if (old[i] == NULL)
+                continue;
+            b = old[i]->hash & (tab->cap - 1);
+            while (tab->strs[b] != NULL)
+                b = (b + 1) & (tab->cap - 1);
+            tab->strs[b] = old[i];
+        }
+        free(old);
+        b = h & (tab->cap - 1);
+        while (tab->strs[b] != NULL)
+            b = (b + 1) & (tab->cap - 1);
+    }
+
+    str = malloc(sizeof(struct istr_t) + len + 1);
+    if (str == NULL)
+        unix_error("intern error");
+    str->hash = h;
+    str->refs = 1;
+    str->len = len;
+    memcpy(str->text, s, len + 1);
+    tab->strs[b] = str;
+    tab->count++;
+    return str->text;
+}
+
+/* unintern - Drop a reference to a string returned by intern */
+void unintern(struct strtab_t *tab, const char *s) {
+    struct istr_t *str = (struct istr_t *)(s - offsetof(struct istr_t, text));
+    unsigned b = str->hash & (tab->cap - 1);
+    unsigned next, home;
+
+    if (--str->refs > 0)
+        return;
+
+    while (tab->strs[b] != str)
+        b = (b + 1) & (tab->cap - 1);
+    free(str);
+
+    // Move later entries of the probe run back into the hole, the same
+    // way pidindex_del does
+    next = b;
+    while (1) {
+        next = (next + 1) & (tab->cap - 1);
+        if (tab->strs[next] == NULL)
+            break;
+        home = tab->strs[next]->hash & (tab->cap - 1);
+        if (((next - home) & (tab->cap - 1)) >= ((next - b) & (tab->cap - 1))) {
+            tab->strs[b] = tab->strs[next];
+            b = next;
         }
     }
+    tab->strs[b] = NULL;
+    tab->count--;
 }
 /******************************
  * end job list helper routines
@@ -779,10 +4817,13 @@ void listjobs(struct job_t *jobs) {
  * usage - print a help message and terminate
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvpr] [-l launcher]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   -r   reap children from a separate thread\n");
+    printf("   -l   launcher for commands: fork (default), spawn,\n");
+    printf("        pool or helper\n");
     exit(1);
 }
 